@@ -45,6 +45,16 @@ typedef bool (*io_reducer_cb)(io_record_t *res, const io_record_t *r,
 typedef int (*io_compare_cb)(const io_record_t *, const io_record_t *,
                                void *tag);
 
+/* Returns a 64 bit prefix of the record's key which agrees with a compare
+   function.  If prefix(a) < prefix(b), then compare(a, b) must be negative.
+   Records with equal prefixes are ordered by the compare function.  Sorts and
+   merges compare the cached prefixes first and only call compare on ties. */
+typedef uint64_t (*io_key_prefix_cb)(const io_record_t *r, void *tag);
+
+/* Returns a hash of the record's key.  Records which compare equal must have
+   the same hash. */
+typedef uint64_t (*io_hash_cb)(const io_record_t *r, void *tag);
+
 /* A function which is expected to return 0..num_part-1 based upon the given record and the user provided tag. */
 typedef size_t (*io_partition_cb)(const io_record_t *r, size_t num_part,
                                     void *tag);
@@ -69,10 +79,40 @@ typedef bool (*io_file_valid_cb)(const char *filename, void *arg);
 _macro_sort_compare_h(io_sort_records, cmp_arg, io_record_t);
 // void io_sort_records(io_record_t *base, size_t n, io_compare_cb cmp, void *arg);
 
+/* Sort records by the prefix returned from key_prefix and then cmp.  This
+   uses 16 bytes of temporary memory per record. */
+void io_sort_records_by_prefix(io_record_t *base, size_t n, io_compare_cb cmp,
+                               void *arg, io_key_prefix_cb key_prefix,
+                               void *key_prefix_arg);
+
+/* Orders which can be sorted by io_sort_records_radix.  bytes is memcmp with
+   shorter records first.  uint32 and uint64 order by the first 32 or 64 bits
+   of the record as an unsigned integer (io_compare_uint32_t and
+   io_compare_uint64_t). */
+typedef enum {
+  io_radix_none = 0,
+  io_radix_bytes = 1,
+  io_radix_uint32 = 2,
+  io_radix_uint64 = 3
+} io_radix_t;
+
+/* Sort records in place with an MSD (American flag) radix sort.  Equal
+   records are not kept in their original order. */
+void io_sort_records_radix(io_record_t *base, size_t n, io_radix_t radix);
+
+/* A key prefix for records compared as bytes (memcmp with shorter records
+   first or strcmp if records do not contain zeros).  The first 8 bytes are
+   returned big endian and padded with zeros. */
+uint64_t io_bytes_key_prefix(const io_record_t *r, void *tag);
+
 /* A commonly used reducer which simply takes the first instance of a record. */
 bool io_keep_first(io_record_t *res, const io_record_t *r,
                       size_t num_r, aml_buffer_t *bh, void *tag);
 
+/* A hash of the whole record (an io_hash_cb for records which are compared
+   as bytes). */
+uint64_t io_hash_record(const io_record_t *r, void *tag);
+
 /* A commonly used partition function which can hash a record or the tail of the record and then assign a
    partition.  To hash the whole record, pass NULL as the tag or a size_t value set to zero.  To hash the whole
    record except the first N bytes, pass a pointer to a size_t set to N. */
@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: 2019–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef _io_async_H
+#define _io_async_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+   This is an internal object used by io_in_base and io_out to keep several
+   reads or writes in flight for a single file (using io_uring on Linux).  The
+   init functions return NULL if io_uring is not available, if the file
+   descriptor is not a regular file, or if the buffer is too small to be worth
+   splitting.  In that case, the caller should continue to use read/write.
+
+   This should not be documented for the website usage.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct io_async_s;
+typedef struct io_async_s io_async_t;
+
+/* reads start at the current offset of fd */
+io_async_t *io_async_reader_init(int fd, size_t buffer_size);
+
+/* returns the number of bytes copied into p (less than len only at the end
+   of the file) or -1 on error (errno is set) */
+ssize_t io_async_read(io_async_t *h, void *p, size_t len);
+
+/* writes start at the current offset of fd */
+io_async_t *io_async_writer_init(int fd, size_t buffer_size);
+
+/* p is copied before returning.  false is returned if this or any earlier
+   write failed (errno is set) */
+bool io_async_write(io_async_t *h, const void *p, size_t len);
+
+/* wait for all writes to finish */
+bool io_async_flush(io_async_t *h);
+
+/* waits for anything in flight, the fd is not closed */
+void io_async_destroy(io_async_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -126,6 +126,39 @@ void io_in_options_lz4(io_in_options_t *h, size_t buffer_size);
 void io_in_options_compressed_buffer_size(io_in_options_t *h,
                                           size_t buffer_size);
 
+/* Map files into memory and parse records in place instead of copying them
+   through the read buffer.  Records are still zero terminated (the mapping is
+   private, so the file itself is never modified).  Pipes and other descriptors
+   which cannot be mapped fall back to read().  gzip files are never mapped and
+   for lz4 files, the compressed stream is mapped. */
+void io_in_options_mmap(io_in_options_t *h);
+
+/* Read up to depth buffers ahead from a helper thread (with read or gzread)
+   so that reading overlaps with parsing.  This is most useful for gzip
+   files and cold disks.  Each buffer is buffer_size bytes (the compressed
+   buffer size for compressed files).  A depth of zero disables read ahead. */
+void io_in_options_prefetch(io_in_options_t *h, size_t depth);
+
+/* Keep several block reads in flight with io_uring (Linux only) instead of
+   blocking in read().  This only applies to plain and lz4 files which are
+   opened by io_in (not a caller's file descriptor) with a buffer of at least
+   256KB and is ignored if prefetch is set.  If io_uring is not available,
+   read() is used. */
+void io_in_options_async(io_in_options_t *h);
+
+/* Decompress lz4 blocks ahead of the cursor using num_threads helper threads.
+   Blocks are still returned in order.  This only applies to lz4 frames with
+   independent blocks and no content checksum, other frames are decompressed
+   on the calling thread.  Each thread holds two blocks (compressed and not)
+   in flight. */
+void io_in_options_decompress_threads(io_in_options_t *h, size_t num_threads);
+
+/* For cursors created with io_in_ext_init, cache a key prefix of each
+   input's current record so that most compares during the merge are
+   resolved without calling the compare function (see io_key_prefix_cb). */
+void io_in_options_key_prefix(io_in_options_t *h, io_key_prefix_cb key_prefix,
+                              void *arg);
+
 /* Within a single cursor, reduce equal items.  In this case, it is assumed
    that the contents are sorted.  */
 void io_in_options_reducer(io_in_options_t *h, io_compare_cb compare,
@@ -156,6 +189,17 @@ io_in_t *io_in_init_with_fd(int fd, bool can_close, io_in_options_t *options);
 io_in_t *io_in_init_with_buffer(void *buf, size_t len, bool can_free,
                                 io_in_options_t *options);
 
+/* Split filename into n cursors over consecutive byte ranges so that the file
+   can be read from n threads.  Each range after the first starts at the
+   next record boundary (after a delimiter or on a multiple of the fixed
+   record size), so every record belongs to exactly one cursor.  Compressed
+   files, csv and prefix formatted files cannot be split and are read
+   entirely by the first cursor (the others are empty).  The returned array
+   has n cursors, each of which must be destroyed, and the array itself must
+   be freed with aml_free. */
+io_in_t **io_in_split(const char *filename, io_in_options_t *options,
+                      size_t n);
+
 /* Use this to create an io_in_t which allows cursoring over an array of
    io_record_t structures. */
 io_in_t *io_in_records_init(io_record_t *records, size_t num_records,
@@ -26,15 +26,35 @@ io_in_base_t *io_in_base_init_gz(const char *filename, int fd, bool can_close,
                                  size_t buffer_size);
 io_in_base_t *io_in_base_init(const char *filename, int fd, bool can_close,
                               size_t buffer_size);
+/* maps regular files into memory, falling back to io_in_base_init for pipes
+   and anything else which cannot be mapped */
+io_in_base_t *io_in_base_init_mmap(const char *filename, int fd, bool can_close,
+                                   size_t buffer_size);
+/* reads length bytes of filename starting at offset */
+io_in_base_t *io_in_base_init_range(const char *filename, size_t offset,
+                                    size_t length, size_t buffer_size,
+                                    bool use_mmap);
 io_in_base_t *io_in_base_init_from_buffer(char *buffer, size_t buffer_size,
                                           bool can_free);
 io_in_base_t *io_in_base_reinit(io_in_base_t *base, size_t buffer_size);
 
+/* read up to depth buffers ahead of the reader from a helper thread */
+void io_in_base_prefetch(io_in_base_t *h, size_t depth);
+
+/* keep several reads in flight with io_uring (files opened by the base) */
+void io_in_base_async(io_in_base_t *h);
+
 const char *io_in_base_filename(io_in_base_t *h);
 
 char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
                                 bool required);
 
+/*
+  returns a pointer to the first delimiter in [p, ep) (ignoring delimiters
+  within quotes if csv is true) or ep if there isn't one
+*/
+char *io_in_base_find_delimiter(char *p, char *ep, int delim, bool csv);
+
 /*
   returns NULL if len bytes not available
 */
@@ -31,8 +31,23 @@ io_out_t *io_out_ext_init(const char *filename, io_out_options_t *options,
 /* write record in the format specified by io_out_options_format(...) */
 bool io_out_write_record(io_out_t *h, const void *d, size_t len);
 
-/* This only works if output is sorted.  This will bypass the writing of the
-   final file and give you access to the cursor. */
+/* Create a writer for one thread which buffers (up to 1MB of) records and
+   hands them to h in batches, so that many threads can write to one output
+   (normal, sorted or partitioned).  Only the partitions a batch has records
+   for are locked (h itself is locked for other outputs or with a bucketed
+   spill), so the partition callback must be thread safe.  Create the thread
+   local writers before the threads start writing (this isn't thread safe),
+   don't write to h directly while they exist and destroy them with
+   io_out_destroy before h. */
+io_out_t *io_out_thread_local(io_out_t *h);
+
+/* This only works if output is sorted or partitioned.  This will bypass the
+   writing of the final file(s) and give you access to the cursor.  Sorted
+   partitions are merged (or read in order if range partitioned) and unsorted
+   partitions are read one after another.  Sorted partitions which fit are
+   kept in memory (up to the buffer size, half of it if the partitions are
+   sorted after partitioning) and the rest are read from tmp files.  NULL is
+   returned if there are no records. */
 io_in_t *io_out_in(io_out_t *h);
 
 /* destroy the output. */
@@ -90,6 +105,22 @@ void io_out_options_write_ack_file(io_out_options_t *h);
 */
 void io_out_options_gz(io_out_options_t *h, int level);
 
+/*
+  Compress gzip output using num_threads helper threads.  Each buffer (at
+  least 256KB) is compressed as its own gzip member and members are written
+  in order.  gunzip and gzip readers (including io_in) read the members as
+  one stream.
+*/
+void io_out_options_gz_threads(io_out_options_t *h, size_t num_threads);
+
+/*
+  Write gzip output as BGZF blocks (members of at most 64KB which record
+  their compressed size and end with an empty block) so that the file can
+  be split or seeked by BGZF aware readers.  This implies at least one
+  helper thread.
+*/
+void io_out_options_gz_bgzf(io_out_options_t *h);
+
 /*
   Set the level of compression, the block size, whether block checksums are
   used, and content checksums.  The default is that the checksums are not
@@ -99,6 +130,22 @@ void io_out_options_lz4(io_out_options_t *h, int level,
                         lz4_block_size_t size, bool block_checksum,
                         bool content_checksum);
 
+/*
+  Compress lz4 blocks using num_threads helper threads.  Blocks are written
+  in the order they were filled.  This is ignored if content checksums are
+  used.  Each thread holds two blocks (compressed and not) in flight.
+*/
+void io_out_options_lz4_threads(io_out_options_t *h, size_t num_threads);
+
+/*
+  Keep several block writes in flight with io_uring (Linux only) instead of
+  blocking in write().  This only applies to plain, lz4 and threaded gzip
+  files which are created by io_out (not append mode or a caller's file
+  descriptor) with a buffer of at least 256KB.  If io_uring is not available,
+  write() is used.
+*/
+void io_out_options_async(io_out_options_t *h);
+
 /* extended options are for partitioned output, sorted output, or both */
 void io_out_ext_options_init(io_out_ext_options_t *h);
 
@@ -114,10 +161,21 @@ void io_out_ext_options_sort_before_partitioning(io_out_ext_options_t *h);
    are being written out using this option. */
 void io_out_ext_options_sort_while_partitioning(io_out_ext_options_t *h);
 
-/* when partitioning and sorting - how many partitions can be sorted at once? */
+/* when partitioning and sorting - how many partitions can be sorted at once?
+   Partitions are sorted largest first.  Each gets a share of the buffer (up
+   to what it needs to be sorted in memory).  Once a thread has no partitions
+   left to sort, it is lent to the partitions which are still sorting and is
+   used the next time one of them sorts a buffer (large enough to split) or
+   merges tmp files. */
 void io_out_ext_options_num_sort_threads(io_out_ext_options_t *h,
                                          size_t num_sort_threads);
 
+/* Sort each buffer using up to sort_threads threads.  The buffer is split
+   into runs which are sorted in parallel and then merged in parallel, using
+   an extra 16 bytes per record while merging. */
+void io_out_ext_options_sort_threads(io_out_ext_options_t *h,
+                                     size_t sort_threads);
+
 /* options for creating a partitioned output */
 void io_out_ext_options_partition(io_out_ext_options_t *h,
                                   io_partition_cb part, void *arg);
@@ -125,6 +183,29 @@ void io_out_ext_options_partition(io_out_ext_options_t *h,
 void io_out_ext_options_num_partitions(io_out_ext_options_t *h,
                                        size_t num_partitions);
 
+/* Partition by ranges of the compare function instead of a partition
+   callback, so that the sorted partitions (in order) are sorted as a whole.
+   The first sample_size records (1000 per partition if zero, or as many as
+   fit in the buffer) are held until num_partitions-1 splitters are chosen
+   from them.  A record goes to the partition after the last splitter which
+   is not greater than it.  The first records are a poor sample of sorted
+   input (such as with sort_before_partitioning), so a sample can also be
+   read from a file instead (records in the given format). */
+void io_out_ext_options_range_partition(io_out_ext_options_t *h,
+                                        size_t sample_size);
+void io_out_ext_options_range_sample_file(io_out_ext_options_t *h,
+                                          const char *filename,
+                                          io_format_t format);
+
+/* Write the unsorted partitions to one spill file instead of a file per
+   partition (which divides the buffer by the number of partitions).  The
+   records are held in the buffer with their partition and each time it
+   fills, the records are written as one block per partition and the blocks
+   are indexed by partition.  A partition is then read from its blocks (in
+   order) to sort it, to write its final file or by io_out_in.  The spill
+   file is not compressed.  This doesn't apply to sort_while_partitioning. */
+void io_out_ext_options_bucketed_spill(io_out_ext_options_t *h);
+
 /* By default, tmp files are written every time the buffer fills and all of the
    tmp files are merged at the end.  This causes the tmp files to be merged
    once the number of tmp files reaches the num_per_group. */
@@ -139,6 +220,20 @@ void io_out_ext_options_intermediate_compare(io_out_ext_options_t *h,
                                              io_compare_cb compare,
                                              void *arg);
 
+/* Cache a key prefix for each record so that the in memory sort and the
+   merge of tmp files compare 64 bit prefixes first and only call compare
+   (and the intermediate compare) on ties.  The prefix must agree with both
+   compare functions (see io_key_prefix_cb). */
+void io_out_ext_options_key_prefix(io_out_ext_options_t *h,
+                                   io_key_prefix_cb key_prefix, void *arg);
+
+/* Sort each buffer with a radix sort instead of comparing records.  This is
+   only valid when the intermediate compare orders records exactly as radix
+   does (memcmp for io_radix_bytes, io_compare_uint32_t for io_radix_uint32,
+   or io_compare_uint64_t for io_radix_uint64).  The compare functions are
+   still used to merge tmp files. */
+void io_out_ext_options_radix_sort(io_out_ext_options_t *h, io_radix_t radix);
+
 /* set the reducers */
 void io_out_ext_options_reducer(io_out_ext_options_t *h,
                                 io_reducer_cb reducer, void *arg);
@@ -149,6 +244,74 @@ void io_out_ext_options_intermediate_reducer(io_out_ext_options_t *h,
                                              io_reducer_cb reducer,
                                              void *arg);
 
+/* Options for sorting fixed length records (io_fixed format).  When a
+   fixed_compare is set, records are packed in the buffer without an
+   io_record_t, sorted in place with the fixed_sort (or a quicksort using the
+   fixed_compare if fixed_sort is not set), reduced with the fixed_reducer
+   and written to tmp files in the fixed format.  The fixed_reducer is given
+   the equal records sequentially in d and should combine them into the
+   first record (returning false to drop them).  The fixed_compare is used in
+   place of io_out_ext_options_compare if compare is not set. */
+void io_out_ext_options_fixed_compare(io_out_ext_options_t *h,
+                                      io_fixed_compare_cb compare, void *arg);
+void io_out_ext_options_fixed_sort(io_out_ext_options_t *h,
+                                   io_fixed_sort_cb sort, void *arg);
+void io_out_ext_options_fixed_reducer(io_out_ext_options_t *h,
+                                      io_fixed_reducer_cb reducer, void *arg);
+
+/* The final merge of tmp files opens at most max_fan_in files.  If there
+   are more tmp files, they are first merged in passes.  Without this option,
+   the fan in is limited by the open file limit and by giving each input at
+   least 1MB of the buffer (but allowing at least 64 inputs). */
+void io_out_ext_options_max_fan_in(io_out_ext_options_t *h,
+                                   size_t max_fan_in);
+
+/* Run the merges of each merge pass on up to merge_threads threads (the
+   buffer and the open file limit are shared by the threads). */
+void io_out_ext_options_merge_threads(io_out_ext_options_t *h,
+                                      size_t merge_threads);
+
+/* Reduce records with equal keys as they are written instead of after the
+   buffer is sorted.  Each record is looked up in a hash table (using hash,
+   or io_hash_record if hash is NULL, and the intermediate compare) and
+   reduced with the record already in the buffer using the intermediate
+   reducer, so the buffer is only sorted and written to a tmp file once it
+   fills with distinct records.  The table uses up to 16 bytes per distinct
+   record in addition to the buffer.  This requires a reducer and does not
+   apply to replacement selection or fixed length sorting. */
+void io_out_ext_options_combiner(io_out_ext_options_t *h, io_hash_cb hash,
+                                 void *arg);
+
+/* Only keep the limit smallest records (by the intermediate compare).  When
+   the buffer fills, it is sorted and reduced and only the first limit
+   records are kept.  After that, records greater than the last kept record
+   are skipped as they are written, so tmp files are not needed.  If the
+   kept records use more than half of the buffer, tmp files are written as
+   usual.  Either way, io_out_in and the output have at most limit records.
+   Records are skipped before they are reduced, so a reducer should not
+   drop records.  The combiner is not used with a limit. */
+void io_out_ext_options_limit(io_out_ext_options_t *h, size_t limit);
+
+/* Generate tmp files with replacement selection instead of sorting a full
+   buffer at a time.  Records are kept in a heap (limited by the buffer size,
+   counting each record's allocation and heap slots, so fewer small records
+   are held than a sort buffer holds) and the smallest record which is not
+   less than the last one written is streamed to the current tmp file.
+   Random input produces tmp files of about twice the records held and
+   nearly sorted input a single tmp file.  The intermediate reducer is not
+   applied to the tmp files and use_extra_thread and fixed length sorting do
+   not apply. */
+void io_out_ext_options_replacement_selection(io_out_ext_options_t *h);
+
+/* Write tmp files (and unsorted partitions) to the given directories
+   instead of next to the output.  Files are assigned to the directories
+   round robin (starting at a directory chosen by the output's filename) and
+   are named after the output's base filename, so outputs which share
+   directories need distinct base filenames.  The directories must exist
+   and are copied when the output is initialized. */
+void io_out_ext_options_tmp_dirs(io_out_ext_options_t *h, char **dirs,
+                                 size_t num_dirs);
+
 /* Use an extra thread when sorting output. */
 void io_out_ext_options_use_extra_thread(io_out_ext_options_t *h);
 
@@ -20,6 +20,10 @@ typedef struct {
 
   bool gz;
   bool lz4;
+  bool use_mmap;
+  size_t prefetch;
+  bool async;
+  size_t decompress_threads;
 
   bool full_record_required;
 
@@ -27,6 +31,9 @@ typedef struct {
   void *compare_arg;
   io_reducer_cb reducer;
   void *reducer_arg;
+
+  io_key_prefix_cb key_prefix;
+  void *key_prefix_arg;
 } io_in_options_t;
 
 void _io_in_empty(io_in_t *h);
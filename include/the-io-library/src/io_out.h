@@ -14,9 +14,13 @@ typedef struct {
   lz4_block_size_t size;
   bool block_checksum;
   bool content_checksum;
+  size_t lz4_threads;
 
   bool gz;
+  size_t gz_threads;
+  bool bgzf;
   bool lz4;
+  bool async;
 } io_out_options_t;
 
 typedef struct {
@@ -27,10 +31,30 @@ typedef struct {
   bool sort_before_partitioning;
   bool sort_while_partitioning;
   size_t num_sort_threads;
+  size_t sort_threads;
+  bool replacement_selection;
+  size_t max_fan_in;
+  size_t merge_threads;
+  /* set for the sorted partitions of a partitioned output, threads which
+     have no partitions left to sort are lent to the others through it */
+  struct io_out_spare_threads_s *spare_threads;
+
+  char **tmp_dirs;
+  size_t num_tmp_dirs;
+
+  bool combiner;
+  io_hash_cb combiner_hash;
+  void *combiner_hash_arg;
+
+  size_t limit;
 
   io_partition_cb partition;
   void *partition_arg;
   size_t num_partitions;
+  size_t range_sample_size;
+  const char *range_sample_file;
+  io_format_t range_sample_format;
+  bool bucketed_spill;
 
   io_compare_cb compare;
   void *compare_arg;
@@ -39,6 +63,10 @@ typedef struct {
   io_compare_cb int_compare;
   void *int_compare_arg;
 
+  io_key_prefix_cb key_prefix;
+  void *key_prefix_arg;
+  io_radix_t radix;
+
   io_reducer_cb reducer;
   void *reducer_arg;
 
@@ -25,12 +25,206 @@
 
 _macro_sort_compare(io_sort_records, cmp_arg, io_record_t);
 
+typedef struct {
+  uint64_t prefix;
+  size_t index;
+} io_prefix_entry_t;
+
+typedef struct {
+  io_record_t *base;
+  io_compare_cb cmp;
+  void *arg;
+} io_prefix_sort_t;
+
+/* macro_sort inlines the less function and doesn't pass an argument, so the
+   records and compare function are per thread (sorts run on several). */
+static __thread io_prefix_sort_t prefix_sort;
+
+static inline bool compare_io_prefix_entry(const io_prefix_entry_t *a,
+                                           const io_prefix_entry_t *b) {
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix;
+  return prefix_sort.cmp(prefix_sort.base + a->index,
+                         prefix_sort.base + b->index, prefix_sort.arg) < 0;
+}
+
+static macro_sort(_sort_io_prefix_entry, io_prefix_entry_t,
+                  compare_io_prefix_entry);
+
+void io_sort_records_by_prefix(io_record_t *base, size_t n, io_compare_cb cmp,
+                               void *arg, io_key_prefix_cb key_prefix,
+                               void *key_prefix_arg) {
+  if (n < 2)
+    return;
+
+  io_prefix_entry_t *entries =
+      (io_prefix_entry_t *)aml_malloc(sizeof(io_prefix_entry_t) * n);
+  for (size_t i = 0; i < n; i++) {
+    entries[i].prefix = key_prefix(base + i, key_prefix_arg);
+    entries[i].index = i;
+  }
+  io_prefix_sort_t saved = prefix_sort;
+  prefix_sort.base = base;
+  prefix_sort.cmp = cmp;
+  prefix_sort.arg = arg;
+  _sort_io_prefix_entry(entries, n);
+  prefix_sort = saved;
+
+  /* move the records into place following each cycle of the permutation */
+  for (size_t i = 0; i < n; i++) {
+    if (entries[i].index == i)
+      continue;
+    io_record_t tmp = base[i];
+    size_t j = i;
+    while (entries[j].index != i) {
+      size_t next = entries[j].index;
+      base[j] = base[next];
+      entries[j].index = j;
+      j = next;
+    }
+    base[j] = tmp;
+    entries[j].index = j;
+  }
+  aml_free(entries);
+}
+
+/* buckets smaller than this are insertion sorted */
+static const size_t IO_RADIX_SMALL = 32;
+
+static inline int io_radix_compare(const io_record_t *a, const io_record_t *b,
+                                   io_radix_t radix, size_t depth) {
+  if (radix == io_radix_bytes) {
+    /* the first depth bytes are known to be equal */
+    uint32_t m = a->length < b->length ? a->length : b->length;
+    int n = memcmp(a->record + depth, b->record + depth, m - depth);
+    if (n)
+      return n;
+    return a->length < b->length ? -1 : (a->length > b->length ? 1 : 0);
+  }
+  if (radix == io_radix_uint32) {
+    uint32_t ka, kb;
+    memcpy(&ka, a->record, sizeof(ka));
+    memcpy(&kb, b->record, sizeof(kb));
+    return ka < kb ? -1 : (ka > kb ? 1 : 0);
+  }
+  uint64_t ka, kb;
+  memcpy(&ka, a->record, sizeof(ka));
+  memcpy(&kb, b->record, sizeof(kb));
+  return ka < kb ? -1 : (ka > kb ? 1 : 0);
+}
+
+/* bucket 0 is for records which end before depth (bytes only) */
+static inline size_t io_radix_bucket(const io_record_t *r, io_radix_t radix,
+                                     size_t depth) {
+  if (radix == io_radix_bytes)
+    return depth < r->length ? ((unsigned char *)r->record)[depth] + 1 : 0;
+  if (radix == io_radix_uint32) {
+    uint32_t k;
+    memcpy(&k, r->record, sizeof(k));
+    return ((k >> ((3 - depth) * 8)) & 0xFF) + 1;
+  }
+  uint64_t k;
+  memcpy(&k, r->record, sizeof(k));
+  return ((k >> ((7 - depth) * 8)) & 0xFF) + 1;
+}
+
+static void io_radix_sort(io_record_t *base, size_t n, io_radix_t radix,
+                          size_t depth) {
+  size_t key_size = radix == io_radix_uint32 ? 4 : 8;
+  while (n > 1) {
+    if (n < IO_RADIX_SMALL) {
+      for (size_t i = 1; i < n; i++) {
+        io_record_t tmp = base[i];
+        size_t j = i;
+        while (j && io_radix_compare(&tmp, base + j - 1, radix, depth) < 0) {
+          base[j] = base[j - 1];
+          j--;
+        }
+        base[j] = tmp;
+      }
+      return;
+    }
+
+    size_t counts[257];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < n; i++)
+      counts[io_radix_bucket(base + i, radix, depth)]++;
+
+    size_t next[257], end[257];
+    size_t pos = 0;
+    for (size_t b = 0; b < 257; b++) {
+      next[b] = pos;
+      pos += counts[b];
+      end[b] = pos;
+    }
+
+    /* American flag permutation, each record moves directly to its bucket */
+    for (size_t b = 0; b < 257; b++) {
+      while (next[b] < end[b]) {
+        io_record_t r = base[next[b]];
+        size_t rb = io_radix_bucket(&r, radix, depth);
+        while (rb != b) {
+          io_record_t tmp = base[next[rb]];
+          base[next[rb]++] = r;
+          r = tmp;
+          rb = io_radix_bucket(&r, radix, depth);
+        }
+        base[next[b]++] = r;
+      }
+    }
+
+    depth++;
+    if (radix != io_radix_bytes && depth == key_size)
+      return;
+
+    /* recurse on all but the largest bucket which is sorted by the loop */
+    size_t largest = 1;
+    for (size_t b = 2; b < 257; b++)
+      if (counts[b] > counts[largest])
+        largest = b;
+    pos = counts[0]; /* records which ended are equal */
+    for (size_t b = 1; b < 257; b++) {
+      if (b != largest && counts[b] > 1)
+        io_radix_sort(base + pos, counts[b], radix, depth);
+      pos += counts[b];
+    }
+    base += end[largest] - counts[largest];
+    n = counts[largest];
+  }
+}
+
+void io_sort_records_radix(io_record_t *base, size_t n, io_radix_t radix) {
+  if (radix == io_radix_none)
+    return;
+  io_radix_sort(base, n, radix, 0);
+}
+
+uint64_t io_bytes_key_prefix(const io_record_t *r, void *tag) {
+  uint64_t prefix = 0;
+  if (r->length >= 8) {
+    memcpy(&prefix, r->record, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    prefix = __builtin_bswap64(prefix);
+#endif
+    return prefix;
+  }
+  const unsigned char *p = (const unsigned char *)r->record;
+  for (uint32_t i = 0; i < r->length; i++)
+    prefix |= ((uint64_t)p[i]) << (56 - (i * 8));
+  return prefix;
+}
+
 bool io_keep_first(io_record_t *res, const io_record_t *r,
                       size_t num_r, aml_buffer_t *bh, void *tag) {
   *res = *r;
   return true;
 }
 
+uint64_t io_hash_record(const io_record_t *r, void *tag) {
+  (void)tag;
+  return lz4_hash64(r->record, r->length);
+}
+
 size_t io_hash_partition(const io_record_t *r, size_t num_part,
                             void *arg) {
   size_t offs = arg ? (*(size_t *)arg) : 0;
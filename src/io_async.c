@@ -0,0 +1,425 @@
+// SPDX-FileCopyrightText: 2019–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#include "the-io-library/io_async.h"
+
+#include "a-memory-library/aml_alloc.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define IO_ASYNC_URING
+#endif
+#endif
+#endif
+
+#ifdef IO_ASYNC_URING
+
+/* Each file keeps IO_ASYNC_DEPTH requests in flight.  The buffer is split so
+   that the extra memory is about the same as the caller's buffer, and files
+   with buffers smaller than IO_ASYNC_MIN_BUFFER keep using read/write. */
+#define IO_ASYNC_DEPTH 4
+#define IO_ASYNC_MIN_BUFFER (256 * 1024)
+#define IO_ASYNC_MAX_BLOCK (1024 * 1024)
+
+typedef struct {
+  char *buffer;
+  size_t length;
+  size_t done;
+  uint64_t offset;
+  bool busy;
+} io_async_slot_t;
+
+struct io_async_s {
+  int fd;
+  int ring_fd;
+  bool writer;
+  bool eof;
+  int error;
+
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  io_async_slot_t slots[IO_ASYNC_DEPTH];
+  size_t block_size;
+  size_t head;
+  size_t num_busy;
+  size_t pos;
+  uint64_t offset;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+/* Checked once per process (readers and writers are created from many
+   threads at once). */
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static bool uring_supported = false;
+
+static void uring_probe(void) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = uring_setup(1, &p);
+  if (fd >= 0) {
+    close(fd);
+    /* IORING_OP_READ and IORING_OP_WRITE arrived with this feature */
+    uring_supported = (p.features & IORING_FEAT_RW_CUR_POS) != 0;
+  }
+}
+
+static bool uring_available(void) {
+  pthread_once(&uring_once, uring_probe);
+  return uring_supported;
+}
+
+static void unmap_rings(io_async_t *h) {
+  if (h->sqes)
+    munmap(h->sqes, h->sqes_size);
+  if (h->cq_ring && h->cq_ring != h->sq_ring)
+    munmap(h->cq_ring, h->cq_ring_size);
+  if (h->sq_ring)
+    munmap(h->sq_ring, h->sq_ring_size);
+}
+
+static io_async_t *io_async_init(int fd, size_t buffer_size, bool writer) {
+  if (fd < 0 || buffer_size < IO_ASYNC_MIN_BUFFER || !uring_available())
+    return NULL;
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+    return NULL;
+
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset == -1)
+    return NULL;
+
+  size_t block_size = buffer_size / IO_ASYNC_DEPTH;
+  if (block_size > IO_ASYNC_MAX_BLOCK)
+    block_size = IO_ASYNC_MAX_BLOCK;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int ring_fd = uring_setup(IO_ASYNC_DEPTH, &p);
+  if (ring_fd < 0)
+    return NULL;
+
+  io_async_t *h = (io_async_t *)aml_zalloc(sizeof(io_async_t) +
+                                           (block_size * IO_ASYNC_DEPTH));
+  h->fd = fd;
+  h->ring_fd = ring_fd;
+  h->writer = writer;
+  h->block_size = block_size;
+  h->offset = offset;
+  char *b = (char *)(h + 1);
+  for (size_t i = 0; i < IO_ASYNC_DEPTH; i++) {
+    h->slots[i].buffer = b;
+    b += block_size;
+  }
+
+  h->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+  h->cq_ring_size =
+      p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (h->cq_ring_size > h->sq_ring_size)
+      h->sq_ring_size = h->cq_ring_size;
+    h->cq_ring_size = h->sq_ring_size;
+  }
+  h->sq_ring = mmap(NULL, h->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (h->sq_ring == MAP_FAILED) {
+    h->sq_ring = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    h->cq_ring = h->sq_ring;
+  else {
+    h->cq_ring = mmap(NULL, h->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (h->cq_ring == MAP_FAILED) {
+      h->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  h->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  h->sqes = (struct io_uring_sqe *)mmap(NULL, h->sqes_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring_fd,
+                                        IORING_OFF_SQES);
+  if (h->sqes == MAP_FAILED) {
+    h->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = (char *)h->sq_ring;
+  char *cq = (char *)h->cq_ring;
+  h->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  h->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  h->sq_array = (unsigned *)(sq + p.sq_off.array);
+  h->cq_head = (unsigned *)(cq + p.cq_off.head);
+  h->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  h->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  h->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return h;
+
+fail:
+  unmap_rings(h);
+  close(ring_fd);
+  aml_free(h);
+  return NULL;
+}
+
+/* submits the unfinished part of slot i */
+static bool submit(io_async_t *h, size_t i) {
+  io_async_slot_t *s = h->slots + i;
+  unsigned tail = *h->sq_tail;
+  unsigned idx = tail & *h->sq_mask;
+  struct io_uring_sqe *sqe = h->sqes + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = h->writer ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = h->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(s->buffer + s->done);
+  sqe->len = s->length - s->done;
+  sqe->off = s->offset + s->done;
+  sqe->user_data = i;
+  h->sq_array[idx] = idx;
+  __atomic_store_n(h->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  int r;
+  while ((r = uring_enter(h->ring_fd, 1, 0, 0)) == -1 && errno == EINTR)
+    ;
+  if (r != 1) {
+    /* take the entry back so it is not submitted later */
+    __atomic_store_n(h->sq_tail, tail, __ATOMIC_RELEASE);
+    if (!h->error)
+      h->error = r == -1 ? errno : EIO;
+    return false;
+  }
+  s->busy = true;
+  return true;
+}
+
+static void complete(io_async_t *h, size_t i, int res) {
+  io_async_slot_t *s = h->slots + i;
+  if (res == -EINTR || res == -EAGAIN) {
+    s->busy = false;
+    submit(h, i);
+    return;
+  }
+  s->busy = false;
+  if (res < 0) {
+    if (!h->error)
+      h->error = -res;
+    return;
+  }
+  if (res == 0) {
+    /* end of file for readers, writers should never see this */
+    if (h->writer) {
+      if (!h->error)
+        h->error = EIO;
+    } else
+      h->eof = true;
+    return;
+  }
+  s->done += res;
+  if (s->done < s->length)
+    submit(h, i);
+}
+
+/* wait for at least one completion and process everything available */
+static void reap(io_async_t *h) {
+  int r;
+  while ((r = uring_enter(h->ring_fd, 0, 1, IORING_ENTER_GETEVENTS)) == -1 &&
+         errno == EINTR)
+    ;
+  if (r == -1) {
+    if (!h->error)
+      h->error = errno;
+    for (size_t i = 0; i < IO_ASYNC_DEPTH; i++)
+      h->slots[i].busy = false;
+    return;
+  }
+
+  unsigned head = *h->cq_head;
+  while (head != __atomic_load_n(h->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = h->cqes + (head & *h->cq_mask);
+    size_t i = (size_t)cqe->user_data;
+    int res = cqe->res;
+    head++;
+    __atomic_store_n(h->cq_head, head, __ATOMIC_RELEASE);
+    complete(h, i, res);
+  }
+}
+
+static void wait_for(io_async_t *h, size_t i) {
+  while (h->slots[i].busy)
+    reap(h);
+}
+
+static bool read_next(io_async_t *h, size_t i) {
+  io_async_slot_t *s = h->slots + i;
+  s->length = h->block_size;
+  s->done = 0;
+  s->offset = h->offset;
+  h->offset += h->block_size;
+  return submit(h, i);
+}
+
+io_async_t *io_async_reader_init(int fd, size_t buffer_size) {
+  io_async_t *h = io_async_init(fd, buffer_size, false);
+  if (!h)
+    return NULL;
+  for (size_t i = 0; i < IO_ASYNC_DEPTH; i++) {
+    if (!read_next(h, i)) {
+      io_async_destroy(h);
+      return NULL;
+    }
+  }
+  return h;
+}
+
+ssize_t io_async_read(io_async_t *h, void *p, size_t len) {
+  char *wp = (char *)p;
+  size_t copied = 0;
+  while (copied < len) {
+    io_async_slot_t *s = h->slots + h->head;
+    wait_for(h, h->head);
+    if (h->error) {
+      errno = h->error;
+      return copied ? (ssize_t)copied : -1;
+    }
+
+    size_t n = s->done - h->pos;
+    if (n > len - copied)
+      n = len - copied;
+    memcpy(wp + copied, s->buffer + h->pos, n);
+    copied += n;
+    h->pos += n;
+    if (h->pos < s->done)
+      break;
+
+    /* a short block is the end of the file */
+    if (s->done < s->length)
+      break;
+
+    h->pos = 0;
+    if (!h->eof)
+      read_next(h, h->head);
+    else
+      s->done = 0;
+    h->head++;
+    if (h->head == IO_ASYNC_DEPTH)
+      h->head = 0;
+  }
+  return copied;
+}
+
+io_async_t *io_async_writer_init(int fd, size_t buffer_size) {
+  return io_async_init(fd, buffer_size, true);
+}
+
+bool io_async_write(io_async_t *h, const void *p, size_t len) {
+  const char *rp = (const char *)p;
+  while (len && !h->error) {
+    if (h->num_busy == IO_ASYNC_DEPTH) {
+      wait_for(h, h->head);
+      h->head++;
+      if (h->head == IO_ASYNC_DEPTH)
+        h->head = 0;
+      h->num_busy--;
+      continue;
+    }
+    size_t i = (h->head + h->num_busy) % IO_ASYNC_DEPTH;
+    io_async_slot_t *s = h->slots + i;
+    size_t n = len > h->block_size ? h->block_size : len;
+    memcpy(s->buffer, rp, n);
+    s->length = n;
+    s->done = 0;
+    s->offset = h->offset;
+    if (!submit(h, i))
+      break;
+    h->offset += n;
+    h->num_busy++;
+    rp += n;
+    len -= n;
+  }
+  if (h->error) {
+    errno = h->error;
+    return false;
+  }
+  return true;
+}
+
+bool io_async_flush(io_async_t *h) {
+  while (h->num_busy) {
+    wait_for(h, h->head);
+    h->head++;
+    if (h->head == IO_ASYNC_DEPTH)
+      h->head = 0;
+    h->num_busy--;
+  }
+  if (h->error) {
+    errno = h->error;
+    return false;
+  }
+  return true;
+}
+
+void io_async_destroy(io_async_t *h) {
+  for (size_t i = 0; i < IO_ASYNC_DEPTH; i++)
+    wait_for(h, i);
+  unmap_rings(h);
+  close(h->ring_fd);
+  aml_free(h);
+}
+
+#else
+
+io_async_t *io_async_reader_init(int fd, size_t buffer_size) { return NULL; }
+
+ssize_t io_async_read(io_async_t *h, void *p, size_t len) {
+  errno = ENOSYS;
+  return -1;
+}
+
+io_async_t *io_async_writer_init(int fd, size_t buffer_size) { return NULL; }
+
+bool io_async_write(io_async_t *h, const void *p, size_t len) {
+  errno = ENOSYS;
+  return false;
+}
+
+bool io_async_flush(io_async_t *h) { return true; }
+
+void io_async_destroy(io_async_t *h) {}
+
+#endif
@@ -94,6 +94,36 @@ struct io_in_list_s {
   io_in_t *cur_in;
 };
 
+/* a block handed to the decompression threads.  Blocks are consumed in the
+   order they were read. */
+typedef struct {
+  char *src;
+  uint32_t length;
+  bool compressed;
+  char *dest;
+  int n;
+  bool done;
+} io_in_lz4_job_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  pthread_t *threads;
+  lz4_t **lz4s;
+  size_t num_threads;
+  size_t started;
+
+  io_in_lz4_job_t *jobs;
+  size_t num_jobs;
+  size_t head;      // next job to hand to the cursor
+  size_t submitted; // next job to fill with compressed data
+  size_t next;      // next job for a thread to decompress
+  uint32_t block_size;
+  bool eof;
+  bool stop;
+} io_in_lz4_pool_t;
+
 struct io_in_s {
   io_in_options_t options;
   int type;
@@ -123,6 +153,7 @@ struct io_in_s {
   uint32_t fixed;
 
   lz4_t *lz4;
+  io_in_lz4_pool_t *pool;
   aml_buffer_t *bh; // for overflow
   io_in_buffer_t buf;
   uint32_t block_size;
@@ -404,6 +435,7 @@ void io_in_reset(io_in_t *h) {
   }
 }
 
+static void lz4_pool_destroy(io_in_lz4_pool_t *pool);
 void io_in_ext_destroy(io_in_t *h);
 void io_in_records_destroy(io_in_t *hp);
 void io_in_destroy_from_list(io_in_t *hp);
@@ -423,6 +455,8 @@ void io_in_destroy(io_in_t *h) {
   else {
     if (h->base)
       io_in_base_destroy(h->base);
+    if (h->pool)
+      lz4_pool_destroy(h->pool);
     if (h->lz4)
       lz4_destroy(h->lz4);
     if (h->out && h->destroy_out)
@@ -442,22 +476,32 @@ void reset_block(io_in_buffer_t *b) {
   b->pos = 0;
 }
 
-static int read_lz4_block(io_in_t *h, io_in_buffer_t *dest) {
+/* reads the next block header and compressed data from base.  The length is
+   zero at the end of the frame. */
+static char *read_lz4_block_data(io_in_t *h, uint32_t *rlen,
+                                 bool *compressed) {
   uint32_t *s = (uint32_t *)io_in_base_read(h->base, 4);
   if (!s)
-    return 0;
+    return NULL;
 
   uint32_t length = *s;
-  bool compressed = true;
+  *compressed = true;
   if (length & 0x80000000U) {
-    compressed = false;
+    *compressed = false;
     length -= 0x80000000U;
   }
   if (!length)
-    return 0;
+    return NULL;
 
   length += h->block_header_size;
-  char *p = io_in_base_read(h->base, length);
+  *rlen = length;
+  return io_in_base_read(h->base, length);
+}
+
+static int read_lz4_block(io_in_t *h, io_in_buffer_t *dest) {
+  uint32_t length;
+  bool compressed;
+  char *p = read_lz4_block_data(h, &length, &compressed);
   if (!p)
     return 0;
 
@@ -470,7 +514,144 @@ static int read_lz4_block(io_in_t *h, io_in_buffer_t *dest) {
   return n;
 }
 
+static void *lz4_pool_thread(void *arg) {
+  io_in_lz4_pool_t *pool = (io_in_lz4_pool_t *)arg;
+  pthread_mutex_lock(&pool->mutex);
+  lz4_t *lz4 = pool->lz4s[pool->started++];
+  while (true) {
+    while (!pool->stop && pool->next == pool->submitted)
+      pthread_cond_wait(&pool->work, &pool->mutex);
+    if (pool->stop)
+      break;
+    io_in_lz4_job_t *job = pool->jobs + (pool->next % pool->num_jobs);
+    pool->next++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    int n = lz4_decompress(lz4, job->src, job->length, job->dest,
+                           pool->block_size, job->compressed);
+
+    pthread_mutex_lock(&pool->mutex);
+    job->n = n;
+    job->done = true;
+    pthread_cond_broadcast(&pool->finished);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static void lz4_pool_destroy(io_in_lz4_pool_t *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+  for (size_t i = 0; i < pool->num_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+  for (size_t i = 0; pool->lz4s[i]; i++)
+    lz4_destroy(pool->lz4s[i]);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->finished);
+  aml_free(pool);
+}
+
+/* Only frames with independent blocks can be decompressed out of order and
+   the content checksum is computed as blocks are decompressed, so those
+   frames are left to the calling thread. */
+static io_in_lz4_pool_t *lz4_pool_init(const char *header, size_t num_threads,
+                                       uint32_t block_size,
+                                       uint32_t compressed_size) {
+  lz4_header_t lh;
+  if (num_threads < 1 || !lz4_check_header(&lh, header, 7) ||
+      !(header[4] & 0x20) || lh.content_checksum)
+    return NULL;
+
+  size_t num_jobs = num_threads * 2;
+  size_t job_size = compressed_size + block_size;
+  io_in_lz4_pool_t *pool = (io_in_lz4_pool_t *)aml_zalloc(
+      sizeof(*pool) + (sizeof(pthread_t) * num_threads) +
+      (sizeof(lz4_t *) * (num_threads + 1)) +
+      (sizeof(io_in_lz4_job_t) * num_jobs) + (job_size * num_jobs));
+  pool->jobs = (io_in_lz4_job_t *)(pool + 1);
+  pool->threads = (pthread_t *)(pool->jobs + num_jobs);
+  pool->lz4s = (lz4_t **)(pool->threads + num_threads);
+  char *p = (char *)(pool->lz4s + num_threads + 1);
+  for (size_t i = 0; i < num_jobs; i++) {
+    pool->jobs[i].src = p;
+    pool->jobs[i].dest = p + compressed_size;
+    p += job_size;
+  }
+  pool->num_jobs = num_jobs;
+  pool->block_size = block_size;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    pool->lz4s[i] = lz4_init_decompress(header, 7);
+    if (!pool->lz4s[i]) {
+      lz4_pool_destroy(pool);
+      return NULL;
+    }
+  }
+  /* num_threads counts the threads which were created (and must be joined) */
+  for (size_t i = 0; i < num_threads; i++) {
+    if (pthread_create(pool->threads + i, NULL, lz4_pool_thread, pool))
+      break;
+    pool->num_threads++;
+  }
+  if (!pool->num_threads) {
+    lz4_pool_destroy(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* keep every job busy, then copy the oldest finished blocks into dest */
+static void fill_blocks_from_pool(io_in_t *h, io_in_lz4_pool_t *pool,
+                                  io_in_buffer_t *dest) {
+  while (dest->used + h->block_size <= dest->size) {
+    while (!pool->eof && pool->submitted - pool->head < pool->num_jobs) {
+      uint32_t length;
+      bool compressed;
+      char *p = read_lz4_block_data(h, &length, &compressed);
+      if (!p) {
+        pool->eof = true;
+        break;
+      }
+      io_in_lz4_job_t *job = pool->jobs + (pool->submitted % pool->num_jobs);
+      memcpy(job->src, p, length);
+      job->length = length;
+      job->compressed = compressed;
+      job->done = false;
+      pthread_mutex_lock(&pool->mutex);
+      pool->submitted++;
+      pthread_cond_signal(&pool->work);
+      pthread_mutex_unlock(&pool->mutex);
+    }
+    if (pool->head == pool->submitted) {
+      dest->eof = true;
+      return;
+    }
+
+    io_in_lz4_job_t *job = pool->jobs + (pool->head % pool->num_jobs);
+    pthread_mutex_lock(&pool->mutex);
+    while (!job->done)
+      pthread_cond_wait(&pool->finished, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    pool->head++;
+    if (job->n <= 0) {
+      dest->eof = true;
+      return;
+    }
+    memcpy(dest->buffer + dest->used, job->dest, job->n);
+    dest->used += job->n;
+  }
+}
+
 static void fill_blocks(io_in_t *h, io_in_buffer_t *dest) {
+  if (h->pool) {
+    fill_blocks_from_pool(h, h->pool, dest);
+    return;
+  }
   while (1) {
     if (dest->used + h->block_size <= dest->size) {
       if (read_lz4_block(h, dest) <= 0) {
@@ -511,6 +692,9 @@ io_in_t *io_in_quick_init(const char *filename, io_format_t format, size_t buffe
   return io_in_init(filename, &opts);
 }
 
+static io_in_t *_io_in_init_from_base(io_in_base_t *base, bool is_lz4,
+                                      io_in_options_t *options);
+
 io_in_t *_io_in_init(const char *filename, int fd, bool can_close, void *buf,
                      size_t buf_len, bool can_free, io_in_options_t *options) {
   io_in_options_t opts;
@@ -543,9 +727,21 @@ io_in_t *_io_in_init(const char *filename, int fd, bool can_close, void *buf,
   } else {
     if ((!filename && options->gz) || io_extension(filename, "gz"))
       base = io_in_base_init_gz(filename, fd, can_close, options->buffer_size);
+    else if (options->use_mmap)
+      base =
+          io_in_base_init_mmap(filename, fd, can_close, options->buffer_size);
     else
       base = io_in_base_init(filename, fd, can_close, options->buffer_size);
+    if (base && options->prefetch)
+      io_in_base_prefetch(base, options->prefetch);
+    else if (base && options->async)
+      io_in_base_async(base);
   }
+  return _io_in_init_from_base(base, is_lz4, options);
+}
+
+static io_in_t *_io_in_init_from_base(io_in_base_t *base, bool is_lz4,
+                                      io_in_options_t *options) {
   io_in_t *h = NULL;
   if (!base) {
     if (options->abort_on_file_not_found)
@@ -566,7 +762,9 @@ io_in_t *_io_in_init(const char *filename, int fd, bool can_close, void *buf,
       _io_in_empty(h);
       return h;
     }
-    lz4_t *lz4 = lz4_init_decompress(headerp, 7);
+    char header[7];
+    memcpy(header, headerp, 7);
+    lz4_t *lz4 = lz4_init_decompress(header, 7);
     if (!lz4) {
       io_in_base_destroy(base);
       if (options->abort_on_error)
@@ -594,6 +792,9 @@ io_in_t *_io_in_init(const char *filename, int fd, bool can_close, void *buf,
     h->buf.size = buffer_size;
     h->block_size = block_size;
     h->block_header_size = block_header_size;
+    if (options->decompress_threads)
+      h->pool = lz4_pool_init(header, options->decompress_threads, block_size,
+                              compressed_size + block_header_size);
 
     h->options = *options;
     h->base = base;
@@ -731,6 +932,8 @@ void io_in_destroy_from_list(io_in_t *hp) {
     aml_free(h->filep->filename);
     h->filep++;
   }
+  if (h->out && h->destroy_out)
+    h->destroy_out(h->out);
   aml_free(h);
 }
 
@@ -741,7 +944,7 @@ io_record_t *advance_cb(io_in_t *hp) {
 
   h->num_current = 0;
   io_record_t *r = h->cur_in->advance(h->cur_in);
-  if (!r) {
+  while (!r) {
     io_in_destroy(h->cur_in);
     h->cur_in = h->cb(h->arg);
     if (!h->cur_in) {
@@ -791,6 +994,8 @@ void io_in_destroy_from_cb(io_in_t *hp) {
     return;
   if (h->cur_in)
     io_in_destroy(h->cur_in);
+  if (h->out && h->destroy_out)
+    h->destroy_out(h->out);
   aml_free(h);
 }
 
@@ -883,9 +1088,97 @@ io_in_t *io_in_init_with_buffer(void *buf, size_t len, bool can_free,
   return _io_in_init(NULL, -1, false, buf, len, can_free, options);
 }
 
+/* returns the first byte after the first delimiter at or after offset (or
+   size if there is none) */
+static size_t next_record_start(int fd, size_t offset, size_t size,
+                                int delim, char *buffer, size_t buffer_size) {
+  while (offset < size) {
+    size_t length = size - offset;
+    if (length > buffer_size)
+      length = buffer_size;
+    ssize_t n = pread(fd, buffer, length, offset);
+    if (n <= 0)
+      break;
+    char *ep = buffer + n;
+    char *p = io_in_base_find_delimiter(buffer, ep, delim, false);
+    if (p < ep)
+      return offset + (p - buffer) + 1;
+    offset += n;
+  }
+  return size;
+}
+
+io_in_t **io_in_split(const char *filename, io_in_options_t *options,
+                      size_t n) {
+  if (!n)
+    return NULL;
+
+  io_in_options_t opts;
+  if (!options) {
+    options = &opts;
+    io_in_options_init(options);
+  }
+
+  io_in_t **r = (io_in_t **)aml_malloc(sizeof(io_in_t *) * n);
+
+  /* csv delimiters may be quoted and compressed files have no offsets that
+     map to records, so these are read by the first cursor */
+  int delim = -1;
+  size_t fixed = 0;
+  if (options->format < 0 && -options->format - 1 < 256)
+    delim = -options->format - 1;
+  else if (options->format > 0)
+    fixed = options->format;
+
+  size_t size = 0;
+  int fd = -1;
+  if ((delim != -1 || fixed) && !options->gz && !options->lz4 &&
+      !io_extension(filename, "gz") && !io_extension(filename, "lz4") &&
+      n > 1) {
+    size = io_file_size(filename);
+    if (size)
+      fd = open(filename, O_RDONLY);
+  }
+  if (fd == -1) {
+    r[0] = io_in_init(filename, options);
+    for (size_t i = 1; i < n; i++)
+      r[i] = io_in_empty();
+    return r;
+  }
+
+  size_t buffer_size = 64 * 1024;
+  char *buffer = delim != -1 ? (char *)aml_malloc(buffer_size) : NULL;
+  size_t start = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t end = size;
+    if (i + 1 < n) {
+      end = ((size / n) * (i + 1)) + (((size % n) * (i + 1)) / n);
+      if (end < start)
+        end = start;
+      if (fixed) {
+        end = ((end + fixed - 1) / fixed) * fixed;
+        if (end > size)
+          end = size;
+      } else if (end > 0)
+        end = next_record_start(fd, end - 1, size, delim, buffer,
+                                buffer_size);
+    }
+    io_in_base_t *base = NULL;
+    if (end > start)
+      base = io_in_base_init_range(filename, start, end - start,
+                                   options->buffer_size, options->use_mmap);
+    r[i] = base ? _io_in_init_from_base(base, false, options) : io_in_empty();
+    start = end;
+  }
+  if (buffer)
+    aml_free(buffer);
+  close(fd);
+  return r;
+}
+
 static inline char *end_of_block(io_in_t *h, int32_t *rlen, char *p, char *ep,
                                  bool required) {
-  if (required)
+  if (required || p == ep)
     return NULL;
   else {
     h->zerop = ep;
@@ -925,31 +1218,14 @@ char *io_in_lz4_read_delimited(io_in_t *h, int32_t *rlen, int delim,
   char *sp = p;
   // 2. search for delimiter between pos/used
   char *ep = b->buffer + b->used;
-  while (p < ep) {
-    if (*p == '\"') {
-       if(csv) {
-          p++;
-        encoded_quote1:
-          while(p < ep && *p != '\"')
-            p++;
-          if(p+1 < ep && p[1] == '\"') {
-            p += 2;
-            goto encoded_quote1;
-          }
-      }
-      if(p < ep)
-        p++;
-    }
-    else if (*p != delim)
-      p++;
-    else {
-      *rlen = (p - sp);
-      b->pos += (*rlen) + 1;
-      h->zerop = p;
-      h->zero = *p;
-      *p = 0;
-      return sp;
-    }
+  p = io_in_base_find_delimiter(p, ep, delim, csv);
+  if (p < ep) {
+    *rlen = (p - sp);
+    b->pos += (*rlen) + 1;
+    h->zerop = p;
+    h->zero = *p;
+    *p = 0;
+    return sp;
   }
 
   // 3. if finished, there is no more data to read, return what is present
@@ -967,31 +1243,14 @@ char *io_in_lz4_read_delimited(io_in_t *h, int32_t *rlen, int delim,
     //b->pos = b->used;
     fill_blocks(h, b);
     char *ep = sp + b->used;
-    while (p < ep) {
-      if (*p == '\"') {
-         if(csv) {
-            p++;
-          encoded_quote2:
-            while(p < ep && *p != '\"')
-              p++;
-            if(p+1 < ep && p[1] == '\"') {
-              p += 2;
-              goto encoded_quote2;
-            }
-        }
-        if(p < ep)
-          p++;
-      }
-      else if (*p != delim)
-        p++;
-      else {
-        *rlen = (p - sp);
-        b->pos += (*rlen) + 1;
-        h->zerop = p;
-        h->zero = *p;
-        *p = 0;
-        return sp;
-      }
+    p = io_in_base_find_delimiter(p, ep, delim, csv);
+    if (p < ep) {
+      *rlen = (p - sp);
+      b->pos += (*rlen) + 1;
+      h->zerop = p;
+      h->zero = *p;
+      *p = 0;
+      return sp;
     }
     if (b->eof) {
       b->pos = b->used;
@@ -1010,30 +1269,13 @@ char *io_in_lz4_read_delimited(io_in_t *h, int32_t *rlen, int delim,
     p = b->buffer;
     sp = p;
     ep = p + b->used;
-    while (p < ep) {
-      if (*p == '\"') {
-         if(csv) {
-            p++;
-          encoded_quote3:
-            while(p < ep && *p != '\"')
-              p++;
-            if(p+1 < ep && p[1] == '\"') {
-              p += 2;
-              goto encoded_quote3;
-            }
-        }
-        if(p < ep)
-          p++;
-      }
-      else if (*p != delim)
-        p++;
-      else {
-        size_t length = (p - sp);
-        b->pos += length + 1;
-        aml_buffer_append(h->bh, b->buffer, length);
-        *rlen = aml_buffer_length(h->bh);
-        return aml_buffer_data(h->bh);
-      }
+    p = io_in_base_find_delimiter(p, ep, delim, csv);
+    if (p < ep) {
+      size_t length = (p - sp);
+      b->pos += length + 1;
+      aml_buffer_append(h->bh, b->buffer, length);
+      *rlen = aml_buffer_length(h->bh);
+      return aml_buffer_data(h->bh);
     }
     if (b->eof) {
       b->pos = b->used;
@@ -1159,7 +1401,9 @@ char *io_in_lz4_read(io_in_t *h, uint32_t len) {
       b->pos = b->used;
       return NULL;
     }
-    return io_in_use_buffer(h, b, len, NULL);
+    int32_t n = 0;
+    p = io_in_use_buffer(h, b, len, &n);
+    return (uint32_t)n == len ? p : NULL;
   } else {
     if (b->eof) {
       b->pos = b->used;
@@ -1167,8 +1411,16 @@ char *io_in_lz4_read(io_in_t *h, uint32_t len) {
     }
     reset_block(b);
     fill_blocks(h, b);
-    if (len > b->used)
-      return io_in_use_buffer(h, b, len, NULL);
+    if (len > b->used) {
+      /* the stream ended before len bytes were available */
+      if (b->eof) {
+        b->pos = b->used;
+        return NULL;
+      }
+      int32_t n = 0;
+      p = io_in_use_buffer(h, b, len, &n);
+      return (uint32_t)n == len ? p : NULL;
+    }
     b->pos = len;
     return b->buffer;
   }
@@ -1233,6 +1485,24 @@ void io_in_options_compressed_buffer_size(io_in_options_t *h,
   h->compressed_buffer_size = buffer_size;
 }
 
+void io_in_options_mmap(io_in_options_t *h) { h->use_mmap = true; }
+
+void io_in_options_prefetch(io_in_options_t *h, size_t depth) {
+  h->prefetch = depth;
+}
+
+void io_in_options_async(io_in_options_t *h) { h->async = true; }
+
+void io_in_options_decompress_threads(io_in_options_t *h, size_t num_threads) {
+  h->decompress_threads = num_threads;
+}
+
+void io_in_options_key_prefix(io_in_options_t *h, io_key_prefix_cb key_prefix,
+                              void *arg) {
+  h->key_prefix = key_prefix;
+  h->key_prefix_arg = arg;
+}
+
 void io_in_options_reducer(io_in_options_t *h, io_compare_cb compare,
                            void *compare_arg, io_reducer_cb reducer,
                            void *reducer_arg) {
@@ -1245,117 +1515,215 @@ void io_in_options_reducer(io_in_options_t *h, io_compare_cb compare,
 /*****************************************************************************
   io_in_ext... functionality
 
-  in_heap_t tracks a heap full of io_in_t objects and sorts based upon given
-  comparison function.
+  in_tree_t is a loser tree (tournament tree) over io_in_t objects ordered by
+  the given comparison function.  nodes[0] is the index of the winning input
+  and nodes[1..size-1] hold the loser of each match.  Input i is the leaf at
+  position size+i, so the parent of position p is p/2.  Exhausted inputs are
+  NULL and lose every match.  Ties go to the lower index, which keeps merges
+  stable with respect to the order in which inputs were added.
+
+  Updating the tree after inputs advance only requires one compare per level
+  (versus two for a binary heap).  in_tree_update accepts a set of changed
+  inputs as long as the set holds the last winner and every input which was
+  equal to it (what io_in_ext_advance_unique returns).  In that case, each
+  unchanged subtree which meets a changed one lost the match, so its winner
+  is the loser stored at that node.
 */
 
-struct in_heap_s;
-typedef struct in_heap_s in_heap_t;
-
-struct in_heap_s {
-  ssize_t size;
-  ssize_t max_size;
-  io_in_t **heap;
+struct in_tree_s;
+typedef struct in_tree_s in_tree_t;
+
+struct in_tree_s {
+  io_in_t **ins;
+  size_t *nodes;
+  size_t *winners; // per position, scratch for update
+  size_t *stamps;  // per position, marks the positions changed in an update
+  size_t *order;   // scratch for update
+  uint64_t *prefixes; // cached key prefix of each input's current record
+  size_t stamp;
+  size_t size;
+  size_t max_size;
+  bool valid;
   io_compare_cb compare;
   void *compare_arg;
+  io_key_prefix_cb key_prefix;
+  void *key_prefix_arg;
 };
 
-static inline void in_heap_init(in_heap_t *h, ssize_t mx,
-                                io_compare_cb compare, void *arg) {
-  h->size = 0;
-  if (mx < 2)
-    mx = 2;
-  h->max_size = mx;
-  h->heap = (io_in_t **)aml_malloc((mx + 1) * sizeof(io_in_t *));
+static inline void in_tree_init(in_tree_t *h, io_compare_cb compare,
+                                void *arg, io_key_prefix_cb key_prefix,
+                                void *key_prefix_arg) {
+  memset(h, 0, sizeof(*h));
   h->compare = compare;
   h->compare_arg = arg;
+  h->key_prefix = key_prefix;
+  h->key_prefix_arg = key_prefix_arg;
+}
+
+static inline void in_tree_destroy(in_tree_t *h) {
+  if (h->ins)
+    aml_free(h->ins);
 }
 
-static inline void in_heap_clear(in_heap_t *h) { h->size = 0; }
+static inline size_t in_tree_size(in_tree_t *h) { return h->size; }
 
-static inline size_t in_heap_max(in_heap_t *h) { return h->max_size; }
+static inline size_t in_tree_max(in_tree_t *h) { return h->max_size; }
 
-static inline void in_heap_destroy(in_heap_t *h) {
-  if (!h)
-    return;
+static inline io_in_t *in_tree_in(in_tree_t *h, size_t i) {
+  return h->ins[i];
+}
 
-  aml_free(h->heap);
+/* returns true if input a should come before input b */
+static inline bool in_tree_less(in_tree_t *h, size_t a, size_t b) {
+  io_in_t *ia = h->ins[a];
+  io_in_t *ib = h->ins[b];
+  if (!ia)
+    return false;
+  if (!ib)
+    return true;
+  if (h->key_prefix && h->prefixes[a] != h->prefixes[b])
+    return h->prefixes[a] < h->prefixes[b];
+  int n = h->compare(ia->current, ib->current, h->compare_arg);
+  return n < 0 || (n == 0 && a < b);
 }
 
-static inline io_in_t **in_heap_base(in_heap_t *h) { return h->heap; }
+static inline bool in_tree_later_node(const size_t *a, const size_t *b) {
+  return *a > *b;
+}
 
-static inline size_t in_heap_size(in_heap_t *h) { return h->size; }
+static macro_sort(in_tree_sort_nodes, size_t, in_tree_later_node);
 
-static inline int in_heap_compare(in_heap_t *h, io_in_t *a, io_in_t *b) {
-  return h->compare(a->current, b->current, h->compare_arg);
+static inline void in_tree_set_prefix(in_tree_t *h, size_t i) {
+  if (h->key_prefix)
+    h->prefixes[i] = h->key_prefix(h->ins[i]->current, h->key_prefix_arg);
 }
 
-static inline int in_heap_compare2(in_heap_t *h, io_record_t *a,
-                                   io_in_t *b) {
-  return h->compare(a, b->current, h->compare_arg);
+static void in_tree_add(in_tree_t *h, io_in_t *in) {
+  if (h->size >= h->max_size) {
+    size_t max_size = h->max_size ? h->max_size * 2 : 16;
+    /* ins, nodes, order, prefixes + winners, stamps (two per position) */
+    io_in_t **ins = (io_in_t **)aml_zalloc((sizeof(io_in_t *) * max_size) +
+                                           (sizeof(size_t) * max_size * 6) +
+                                           (sizeof(uint64_t) * max_size));
+    size_t *nodes = (size_t *)(ins + max_size);
+    uint64_t *prefixes = (uint64_t *)(nodes + (max_size * 6));
+    if (h->ins) {
+      memcpy(ins, h->ins, sizeof(io_in_t *) * h->size);
+      memcpy(prefixes, h->prefixes, sizeof(uint64_t) * h->size);
+      aml_free(h->ins);
+    }
+    h->ins = ins;
+    h->nodes = nodes;
+    h->order = nodes + max_size;
+    h->winners = h->order + max_size;
+    h->stamps = h->winners + (max_size * 2);
+    h->prefixes = prefixes;
+    h->max_size = max_size;
+  }
+  h->ins[h->size] = in;
+  in_tree_set_prefix(h, h->size);
+  h->size++;
+  h->valid = false;
 }
 
-void test_heap(in_heap_t *h) {
-  for (size_t i = 1; i <= h->size; i++) {
-    if (h->heap[i] == NULL)
-      abort();
+static void in_tree_build(in_tree_t *h) {
+  size_t k = h->size;
+  h->valid = true;
+  h->nodes[0] = 0;
+  if (k < 2)
+    return;
+  size_t *winners = h->winners;
+  for (size_t i = 0; i < k; i++)
+    winners[k + i] = i;
+  for (size_t p = k - 1; p > 0; p--) {
+    size_t a = winners[p << 1];
+    size_t b = winners[(p << 1) + 1];
+    if (in_tree_less(h, a, b)) {
+      winners[p] = a;
+      h->nodes[p] = b;
+    } else {
+      winners[p] = b;
+      h->nodes[p] = a;
+    }
   }
+  h->nodes[0] = winners[1];
 }
 
-static inline void in_heap_push(in_heap_t *h, io_in_t *item) {
-  if (h->size >= h->max_size) {
-    h->max_size = h->size * 2;
-    io_in_t **heap =
-        (io_in_t **)aml_malloc((h->max_size + 1) * sizeof(io_in_t *));
-    memcpy(heap, h->heap, ((h->size + 1) * sizeof(io_in_t *)));
-    aml_free(h->heap);
-    h->heap = heap;
+/* replay the matches above the changed inputs from the bottom up */
+static void in_tree_update(in_tree_t *h, const size_t *changed,
+                           size_t num_changed) {
+  size_t k = h->size;
+  if (k < 2)
+    return;
+  size_t stamp = ++h->stamp;
+  size_t *stamps = h->stamps;
+  size_t *winners = h->winners;
+  size_t num_order = 0;
+  for (size_t i = 0; i < num_changed; i++) {
+    size_t p = k + changed[i];
+    stamps[p] = stamp;
+    winners[p] = changed[i];
+    p >>= 1;
+    while (p && stamps[p] != stamp) {
+      stamps[p] = stamp;
+      h->order[num_order++] = p;
+      p >>= 1;
+    }
   }
-  h->size++;
-  ssize_t num = h->size;
-  io_in_t **heap = h->heap;
-  // io_in_t *tmp = heap[num];
-  heap[num] = item;
-  // heap[0] = tmp;
-  ssize_t i = num;
-  ssize_t j = i >> 1;
-  io_in_t *tmp;
-
-  while (j > 0 && in_heap_compare(h, heap[i], heap[j]) < 0) {
-    tmp = heap[i];
-    heap[i] = heap[j];
-    heap[j] = tmp;
-    i = j;
-    j = j >> 1;
-  }
-}
-
-static inline io_in_t *in_heap_pop(in_heap_t *h) {
-  h->size--;
-  ssize_t num = h->size;
-  io_in_t **heap = h->heap;
-  io_in_t *r = heap[1];
-  heap[1] = heap[num + 1];
-
-  ssize_t i = 1;
-  ssize_t j = i << 1;
-  ssize_t k = j + 1;
-
-  if (k <= num && in_heap_compare(h, heap[k], heap[j]) < 0)
-    j = k;
-
-  while (j <= num && in_heap_compare(h, heap[j], heap[i]) < 0) {
-    io_in_t *tmp = heap[i];
-    heap[i] = heap[j];
-    heap[j] = tmp;
-
-    i = j;
-    j = i << 1;
-    k = j + 1;
-    if (k <= num && in_heap_compare(h, heap[k], heap[j]) < 0)
-      j = k;
+  /* children have higher positions than their parents */
+  if (num_changed > 1)
+    in_tree_sort_nodes(h->order, num_order);
+
+  for (size_t i = 0; i < num_order; i++) {
+    size_t p = h->order[i];
+    size_t left = p << 1;
+    size_t a = stamps[left] == stamp ? winners[left] : h->nodes[p];
+    size_t b = stamps[left + 1] == stamp ? winners[left + 1] : h->nodes[p];
+    if (in_tree_less(h, a, b)) {
+      winners[p] = a;
+      h->nodes[p] = b;
+    } else {
+      winners[p] = b;
+      h->nodes[p] = a;
+    }
   }
-  return r;
+  h->nodes[0] = winners[1];
+}
+
+/* the winning input or NULL if every input is exhausted */
+static inline size_t in_tree_winner(in_tree_t *h) { return h->nodes[0]; }
+
+/* fills res with the winner followed by every input which is equal to it
+   and returns the count.  An input equal to the winner must have lost to
+   another equal input, so only the losers along the paths of equal inputs
+   are checked. */
+static size_t in_tree_equal(in_tree_t *h, size_t *res) {
+  size_t k = h->size;
+  size_t num_res = 0;
+  size_t w = h->nodes[0];
+  res[num_res++] = w;
+  if (k < 2)
+    return num_res;
+
+  io_record_t *first = h->ins[w]->current;
+  /* res doubles as the stack of inputs whose paths are to be checked.  Each
+     entry's path stops below the node where it lost (top). */
+  size_t *tops = h->order;
+  tops[0] = 0;
+  for (size_t i = 0; i < num_res; i++) {
+    size_t top = tops[i];
+    for (size_t p = (k + res[i]) >> 1; p > top; p >>= 1) {
+      size_t loser = h->nodes[p];
+      io_in_t *in = h->ins[loser];
+      if (!in || (h->key_prefix && h->prefixes[loser] != h->prefixes[w]))
+        continue;
+      if (!h->compare(first, in->current, h->compare_arg)) {
+        tops[num_res] = p;
+        res[num_res++] = loser;
+      }
+    }
+  }
+  return num_res;
 }
 
 /*
@@ -1382,12 +1750,12 @@ typedef struct {
   void (*destroy_out)(io_out_t *out);
   aml_buffer_t *group_bh;
 
-  io_in_t **active;
+  size_t *active; // inputs which are current
   size_t num_active;
   size_t active_size;
   io_record_t *r;
 
-  in_heap_t heap;
+  in_tree_t tree;
 
   aml_buffer_t *reducer_bh;
   io_reducer_cb reducer;
@@ -1410,7 +1778,8 @@ io_in_t *io_in_ext_init(io_compare_cb compare, void *arg,
   h->compare = compare;
   h->compare_arg = arg;
   h->options = *options;
-  in_heap_init(&(h->heap), 0, compare, arg);
+  in_tree_init(&(h->tree), compare, arg, options->key_prefix,
+               options->key_prefix_arg);
 
   _io_in_empty((io_in_t *)h);
   return (io_in_t *)h;
@@ -1421,18 +1790,14 @@ void io_in_ext_destroy(io_in_t *hp) {
   if (!h)
     return;
 
-  for (size_t i = 0; i < h->num_active; i++)
-    io_in_destroy(h->active[i]);
-
   if (h->active)
     aml_free(h->active);
 
-  in_heap_t *heap = &(h->heap);
+  in_tree_t *tree = &(h->tree);
+  for (size_t i = 0; i < in_tree_size(tree); i++)
+    io_in_destroy(in_tree_in(tree, i));
 
-  while (in_heap_size(heap))
-    io_in_destroy(in_heap_pop(heap));
-
-  in_heap_destroy(heap);
+  in_tree_destroy(tree);
 
   if (h->reducer_bh)
     aml_buffer_destroy(h->reducer_bh);
@@ -1440,42 +1805,38 @@ void io_in_ext_destroy(io_in_t *hp) {
   if (h->group_bh)
     aml_buffer_destroy(h->group_bh);
 
-  if (h->out)
-    io_out_destroy(h->out);
+  if (h->out && h->destroy_out)
+    h->destroy_out(h->out);
 
   aml_free(h);
 }
 
-static void move_active_to_heap(io_in_ext_t *h, bool advance) {
-  if (!h)
-    return;
-
-  in_heap_t *heap = &(h->heap);
-  for (size_t i = 0; i < h->num_active; i++) {
-    io_in_t *in = h->active[i];
-    if (advance) {
-      if (!io_in_advance(in)) {
-        io_in_destroy(in);
-        continue;
-      }
-    }
-    in_heap_push(heap, in);
-  }
-  h->num_active = 0;
-}
-
 io_record_t *io_in_ext_advance(io_in_t *hp) {
   if (!hp)
     return NULL;
 
   io_in_ext_t *h = (io_in_ext_t *)hp;
-  move_active_to_heap(h, true);
-  in_heap_t *heap = &(h->heap);
-  if (in_heap_size(heap)) {
-    io_in_t *in = in_heap_pop(heap);
-    h->active[0] = in;
+  in_tree_t *tree = &(h->tree);
+  if (!tree->valid)
+    in_tree_build(tree);
+  else if (h->num_active) {
+    for (size_t i = 0; i < h->num_active; i++) {
+      size_t n = h->active[i];
+      if (!io_in_advance(tree->ins[n])) {
+        io_in_destroy(tree->ins[n]);
+        tree->ins[n] = NULL;
+      } else
+        in_tree_set_prefix(tree, n);
+    }
+    in_tree_update(tree, h->active, h->num_active);
+  }
+  h->num_active = 0;
+
+  size_t w = in_tree_winner(tree);
+  if (w < in_tree_size(tree) && tree->ins[w]) {
+    h->active[0] = w;
     h->num_active = 1;
-    h->current = io_in_current(in);
+    h->current = io_in_current(tree->ins[w]);
     return h->current;
   }
   _io_in_empty(hp);
@@ -1488,22 +1849,11 @@ io_record_t *io_in_ext_advance_unique(io_in_t *hp, size_t *num_r) {
     return NULL;
 
   io_in_ext_t *h = (io_in_ext_t *)hp;
-  in_heap_t *heap = &(h->heap);
-  io_in_t **activep = h->active + 1;
+  in_tree_t *tree = &(h->tree);
+  h->num_active = in_tree_equal(tree, h->active);
   io_record_t *rp = h->r;
-  *rp++ = *first;
-  io_in_t *in = NULL;
-  while (in_heap_size(heap)) {
-    in = in_heap_pop(heap);
-    if (!in_heap_compare2(heap, first, in)) {
-      *activep++ = in;
-      *rp++ = *io_in_current(in);
-    } else {
-      in_heap_push(heap, in);
-      break;
-    }
-  }
-  h->num_active = activep - h->active;
+  for (size_t i = 0; i < h->num_active; i++)
+    *rp++ = *io_in_current(tree->ins[h->active[i]]);
   h->num_current = h->num_active;
   h->current = h->r;
   *num_r = h->num_current;
@@ -1540,16 +1890,16 @@ void io_in_ext_add(io_in_t *hp, io_in_t *in, int tag) {
     return;
   }
 
-  in_heap_t *heap = &(h->heap);
-  move_active_to_heap(h, false);
-  in_heap_push(heap, in);
+  /* current inputs are not advanced after an add */
+  in_tree_t *tree = &(h->tree);
+  in_tree_add(tree, in);
 
-  if (h->active_size < in_heap_size(heap)) {
+  if (h->active_size < in_tree_size(tree)) {
     if (h->active)
       aml_free(h->active);
-    h->active_size = in_heap_max(heap);
-    h->active = (io_in_t **)aml_malloc(
-        (sizeof(io_in_t *) + sizeof(io_record_t)) * h->active_size);
+    h->active_size = in_tree_max(tree);
+    h->active = (size_t *)aml_malloc(
+        (sizeof(io_record_t) + sizeof(size_t)) * h->active_size);
     h->r = (io_record_t *)(h->active + h->active_size);
   }
   h->num_active = 0;
@@ -1624,8 +1974,8 @@ void io_in_records_destroy(io_in_t *hp) {
     aml_buffer_destroy(h->reducer_bh);
   if (h->group_bh)
     aml_buffer_destroy(h->group_bh);
-  if (h->out)
-    io_out_destroy(h->out);
+  if (h->out && h->destroy_out)
+    h->destroy_out(h->out);
   aml_free(h);
 }
 
@@ -3,25 +3,65 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "the-io-library/io_in_base.h"
+#include "the-io-library/io_async.h"
 
 #include "a-memory-library/aml_buffer.h"
 #include "a-memory-library/aml_alloc.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
+/* read ahead state, filled by a helper thread.  This is allocated apart from
+   io_in_base_t because io_in_base_reinit moves the base. */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  int fd;
+  gzFile gz;
+
+  char **chunks;
+  size_t *lengths;
+  size_t chunk_size;
+  size_t depth;
+  size_t head;
+  size_t num_filled;
+  size_t pos;
+  bool eof;
+  bool stop;
+} io_in_prefetch_t;
+
 struct io_in_base_s {
   io_in_buffer_t buf;
   char *filename;
   int fd;
   gzFile gz;
   bool can_close;
+  bool opened;
   aml_buffer_t *bh;
   char *zerop;
   char zero;
+
+  /* for ranges of a file, no more than remaining bytes are read */
+  bool limited;
+  size_t remaining;
+
+  /* for memory mapped input, buf.buffer points into map */
+  char *map;
+  size_t map_size;
+  size_t map_offset;
+  size_t released;
+  size_t release_size;
+
+  io_in_prefetch_t *prefetch;
+  io_async_t *async;
 };
 
 static inline void reset_block(io_in_buffer_t *b) {
@@ -30,27 +70,188 @@ static inline void reset_block(io_in_buffer_t *b) {
   b->pos = 0;
 }
 
+static void fill_from_prefetch(io_in_prefetch_t *pf, io_in_buffer_t *b) {
+  size_t bytes = b->size - b->used;
+  while (bytes) {
+    pthread_mutex_lock(&pf->mutex);
+    while (!pf->num_filled && !pf->eof)
+      pthread_cond_wait(&pf->cond, &pf->mutex);
+    if (!pf->num_filled) {
+      pthread_mutex_unlock(&pf->mutex);
+      b->eof = true;
+      b->size = b->used;
+      return;
+    }
+    pthread_mutex_unlock(&pf->mutex);
+
+    size_t length = pf->lengths[pf->head] - pf->pos;
+    if (length > bytes)
+      length = bytes;
+    memcpy(b->buffer + b->used, pf->chunks[pf->head] + pf->pos, length);
+    b->used += length;
+    bytes -= length;
+    pf->pos += length;
+    if (pf->pos == pf->lengths[pf->head]) {
+      pthread_mutex_lock(&pf->mutex);
+      pf->head++;
+      if (pf->head == pf->depth)
+        pf->head = 0;
+      pf->num_filled--;
+      pf->pos = 0;
+      pthread_cond_signal(&pf->cond);
+      pthread_mutex_unlock(&pf->mutex);
+    }
+  }
+}
+
 static void fill_blocks(io_in_base_t *h, io_in_buffer_t *b) {
   if (b->eof)
     return;
 
+  if (h->prefetch) {
+    fill_from_prefetch(h->prefetch, b);
+    return;
+  }
+
   int bytes = b->size - b->used;
+  if (h->limited && (size_t)bytes > h->remaining)
+    bytes = h->remaining;
   int n;
-  if (h->fd != -1)
+  if (h->async)
+    n = io_async_read(h->async, b->buffer + b->used, bytes);
+  else if (h->fd != -1)
     n = read(h->fd, b->buffer + b->used, bytes);
   else if (h->gz)
     n = gzread(h->gz, b->buffer + b->used, bytes);
   else
     return;
 
-  if (n >= 0)
+  if (n >= 0) {
     b->used += n;
-  if (n < bytes) {
+    if (h->limited)
+      h->remaining -= n;
+  }
+  if (n < bytes || (h->limited && !h->remaining)) {
     b->eof = true;
     b->size = b->used;
   }
 }
 
+static void *prefetch_thread(void *arg) {
+  io_in_prefetch_t *pf = (io_in_prefetch_t *)arg;
+  size_t tail = 0;
+  while (true) {
+    pthread_mutex_lock(&pf->mutex);
+    while (pf->num_filled == pf->depth && !pf->stop)
+      pthread_cond_wait(&pf->cond, &pf->mutex);
+    if (pf->stop) {
+      pthread_mutex_unlock(&pf->mutex);
+      break;
+    }
+    pthread_mutex_unlock(&pf->mutex);
+
+    /* the slot at tail is not visible to the reader until num_filled is
+       incremented, so it is filled without holding the lock */
+    char *p = pf->chunks[tail];
+    size_t length = 0;
+    bool eof = false;
+    while (length < pf->chunk_size) {
+      ssize_t n;
+      if (pf->gz)
+        n = gzread(pf->gz, p + length, pf->chunk_size - length);
+      else
+        n = read(pf->fd, p + length, pf->chunk_size - length);
+      if (n <= 0) {
+        eof = true;
+        break;
+      }
+      length += n;
+    }
+
+    pthread_mutex_lock(&pf->mutex);
+    if (length) {
+      pf->lengths[tail] = length;
+      tail++;
+      if (tail == pf->depth)
+        tail = 0;
+      pf->num_filled++;
+    }
+    pf->eof = eof;
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    if (eof)
+      break;
+  }
+  return NULL;
+}
+
+void io_in_base_async(io_in_base_t *h) {
+  /* only files opened here, the offset of a caller's fd is left alone */
+  if (!h->opened || h->prefetch || h->async || h->map || h->buf.eof)
+    return;
+  h->async = io_async_reader_init(h->fd, h->buf.size);
+}
+
+void io_in_base_prefetch(io_in_base_t *h, size_t depth) {
+  if (!depth || h->prefetch || h->async || h->map || h->buf.eof ||
+      (h->fd == -1 && !h->gz))
+    return;
+
+  size_t chunk_size = h->buf.size;
+  io_in_prefetch_t *pf = (io_in_prefetch_t *)aml_zalloc(
+      sizeof(io_in_prefetch_t) + (sizeof(char *) + sizeof(size_t)) * depth +
+      chunk_size * depth);
+  pf->chunks = (char **)(pf + 1);
+  pf->lengths = (size_t *)(pf->chunks + depth);
+  char *p = (char *)(pf->lengths + depth);
+  for (size_t i = 0; i < depth; i++) {
+    pf->chunks[i] = p;
+    p += chunk_size;
+  }
+  pf->chunk_size = chunk_size;
+  pf->depth = depth;
+  pf->fd = h->fd;
+  pf->gz = h->gz;
+  pthread_mutex_init(&pf->mutex, NULL);
+  pthread_cond_init(&pf->cond, NULL);
+  if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0) {
+    pthread_mutex_destroy(&pf->mutex);
+    pthread_cond_destroy(&pf->cond);
+    aml_free(pf);
+    return;
+  }
+  h->prefetch = pf;
+}
+
+static void prefetch_destroy(io_in_prefetch_t *pf) {
+  pthread_mutex_lock(&pf->mutex);
+  pf->stop = true;
+  pthread_cond_signal(&pf->cond);
+  pthread_mutex_unlock(&pf->mutex);
+  pthread_join(pf->thread, NULL);
+  pthread_mutex_destroy(&pf->mutex);
+  pthread_cond_destroy(&pf->cond);
+  aml_free(pf);
+}
+
+/* Pages of a mapping which have been consumed are handed back to the OS.
+   Writing the zero terminators dirties (copies) the private pages, so without
+   this the resident size would grow to the size of the file. */
+static void release_consumed(io_in_base_t *h) {
+  size_t pos = h->map_offset + h->buf.pos;
+  if (pos < h->released + h->release_size)
+    return;
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t end = pos & ~(page_size - 1);
+  if (end <= h->released)
+    return;
+#ifdef MADV_DONTNEED
+  madvise(h->map + h->released, end - h->released, MADV_DONTNEED);
+#endif
+  h->released = end;
+}
+
 static inline void cleanup_last_read(io_in_base_t *h) {
   if (h->bh) {
     aml_buffer_destroy(h->bh);
@@ -61,12 +262,15 @@ static inline void cleanup_last_read(io_in_base_t *h) {
     (*h->zerop) = h->zero;
     h->zerop = NULL;
   }
+
+  if (h->map)
+    release_consumed(h);
 }
 
 const char *io_in_base_filename(io_in_base_t *h) { return h->filename; }
 
 io_in_base_t *io_in_base_reinit(io_in_base_t *base, size_t buffer_size) {
-  if (base->fd == -1 && base->gz == NULL)
+  if ((base->fd == -1 && base->gz == NULL) || base->map)
     return base;
 
   size_t filename_length = base->filename ? strlen(base->filename) + 1 : 0;
@@ -118,13 +322,10 @@ io_in_base_t *io_in_base_init_gz(const char *filename, int fd, bool can_close,
   return h;
 }
 
-io_in_base_t *io_in_base_init(const char *filename, int fd, bool can_close,
-                              size_t buffer_size) {
-  if (fd == -1)
-    fd = open(filename, O_RDONLY);
-  if (fd == -1)
-    return NULL;
-
+static io_in_base_t *_io_in_base_init(const char *filename, int fd,
+                                      bool can_close, size_t buffer_size,
+                                      bool opened, bool limited,
+                                      size_t length) {
   if (buffer_size < 256)
     buffer_size = 256;
 
@@ -140,10 +341,114 @@ io_in_base_t *io_in_base_init(const char *filename, int fd, bool can_close,
   }
   h->fd = fd;
   h->can_close = can_close;
+  h->limited = limited;
+  h->remaining = length;
+  h->opened = opened;
   fill_blocks(h, &(h->buf));
   return h;
 }
 
+io_in_base_t *io_in_base_init(const char *filename, int fd, bool can_close,
+                              size_t buffer_size) {
+  bool opened = false;
+  if (fd == -1) {
+    fd = open(filename, O_RDONLY);
+    opened = true;
+  }
+  if (fd == -1)
+    return NULL;
+
+  return _io_in_base_init(filename, fd, can_close, buffer_size, opened, false,
+                          0);
+}
+
+/* maps length bytes starting at offset or returns NULL */
+static io_in_base_t *_io_in_base_init_mmap(const char *filename, int fd,
+                                           bool can_close, size_t buffer_size,
+                                           size_t offset, size_t length) {
+  /* Reserve one page beyond the end of the range so that a zero can always
+     be placed after the last record.  The file is mapped privately over the
+     front of the reservation (starting on the page containing offset). */
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t map_offset = offset & (page_size - 1);
+  size_t map_length = map_offset + length;
+  size_t map_size =
+      ((map_length + page_size - 1) & ~(page_size - 1)) + page_size;
+  char *map = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  if (mmap(map, map_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, offset - map_offset) == MAP_FAILED) {
+    munmap(map, map_size);
+    return NULL;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(map, map_length, MADV_SEQUENTIAL);
+#endif
+
+  size_t filename_length = filename ? strlen(filename) + 1 : 0;
+  io_in_base_t *h =
+      (io_in_base_t *)aml_zalloc(sizeof(io_in_base_t) + filename_length);
+  if (filename_length) {
+    h->filename = (char *)(h + 1);
+    strcpy(h->filename, filename);
+  }
+  h->fd = fd;
+  h->can_close = can_close;
+  h->map = map;
+  h->map_size = map_size;
+  h->map_offset = map_offset;
+  if (buffer_size < page_size)
+    buffer_size = page_size;
+  h->release_size = buffer_size;
+  h->buf.buffer = map + map_offset;
+  h->buf.size = length;
+  h->buf.used = length;
+  h->buf.eof = true;
+  return h;
+}
+
+io_in_base_t *io_in_base_init_mmap(const char *filename, int fd, bool can_close,
+                                   size_t buffer_size) {
+  if (fd == -1)
+    fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat sb;
+  io_in_base_t *h = NULL;
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+      (uint64_t)sb.st_size <= (uint64_t)(SIZE_MAX / 2))
+    h = _io_in_base_init_mmap(filename, fd, can_close, buffer_size, 0,
+                              sb.st_size);
+  if (!h)
+    h = io_in_base_init(filename, fd, can_close, buffer_size);
+  return h;
+}
+
+io_in_base_t *io_in_base_init_range(const char *filename, size_t offset,
+                                    size_t length, size_t buffer_size,
+                                    bool use_mmap) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  io_in_base_t *h = NULL;
+  if (use_mmap && length)
+    h = _io_in_base_init_mmap(filename, fd, true, buffer_size, offset, length);
+  if (!h) {
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+      close(fd);
+      return NULL;
+    }
+    if (buffer_size > length)
+      buffer_size = length;
+    h = _io_in_base_init(filename, fd, true, buffer_size, true, true, length);
+  }
+  return h;
+}
+
 io_in_base_t *io_in_base_init_from_buffer(char *buffer, size_t buffer_size,
                                           bool can_free) {
   io_in_base_t *h = (io_in_base_t *)aml_zalloc(sizeof(io_in_base_t));
@@ -158,7 +463,7 @@ io_in_base_t *io_in_base_init_from_buffer(char *buffer, size_t buffer_size,
 
 static inline char *end_of_block(io_in_base_t *h, int32_t *rlen, char *p,
                                  char *ep, bool required) {
-  if (required)
+  if (required || p == ep)
     return NULL;
   else {
     h->zerop = ep;
@@ -169,6 +474,170 @@ static inline char *end_of_block(io_in_base_t *h, int32_t *rlen, char *p,
   }
 }
 
+/* Delimiter scanning.  The scalar loops are the fallback, the SSE2 and AVX2
+   kernels are picked once at runtime and test 16 to 64 bytes per step.
+
+   For csv, a byte is within quotes if an odd number of quotes precede it
+   (an escaped quote "" toggles twice, so it never changes the state of the
+   bytes around it).  The vector kernels build a bitmask of quotes and of
+   delimiters for each 64 byte block, turn the quote mask into an in-quote
+   mask with a prefix xor (carrying the state from the previous block) and
+   then jump straight to the first delimiter which is not quoted. */
+static char *find_either_scalar(char *p, char *ep, char a, char b) {
+  while (p < ep && *p != a && *p != b)
+    p++;
+  return p;
+}
+
+static char *find_csv_scalar(char *p, char *ep, char delim, bool quoted) {
+  for (; p < ep; p++) {
+    if (*p == '\"')
+      quoted = !quoted;
+    else if (*p == delim && !quoted)
+      return p;
+  }
+  return p;
+}
+
+typedef char *(*find_either_cb)(char *p, char *ep, char a, char b);
+typedef char *(*find_csv_cb)(char *p, char *ep, char delim, bool quoted);
+
+static find_either_cb find_either = find_either_scalar;
+static find_csv_cb find_csv = find_csv_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) static char *
+find_either_sse2(char *p, char *ep, char a, char b) {
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  for (; p + 16 <= ep; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    if (m)
+      return p + __builtin_ctz(m);
+  }
+  return find_either_scalar(p, ep, a, b);
+}
+
+__attribute__((target("avx2"))) static char *
+find_either_avx2(char *p, char *ep, char a, char b) {
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  for (; p + 32 <= ep; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t m = (uint32_t)_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    if (m)
+      return p + __builtin_ctz(m);
+  }
+  return find_either_sse2(p, ep, a, b);
+}
+
+static inline uint64_t prefix_xor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+__attribute__((target("sse2"))) static inline uint64_t
+mask_sse2(char *p, __m128i v) {
+  uint64_t m0 = (uint16_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), v));
+  uint64_t m1 = (uint16_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), v));
+  uint64_t m2 = (uint16_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), v));
+  uint64_t m3 = (uint16_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), v));
+  return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+
+__attribute__((target("sse2"))) static char *
+find_csv_sse2(char *p, char *ep, char delim, bool quoted) {
+  __m128i vq = _mm_set1_epi8('\"');
+  __m128i vd = _mm_set1_epi8(delim);
+  uint64_t inside = quoted ? ~0ULL : 0;
+  for (; p + 64 <= ep; p += 64) {
+    uint64_t quotes = mask_sse2(p, vq);
+    uint64_t delims = mask_sse2(p, vd);
+    uint64_t within = prefix_xor(quotes) ^ inside;
+    delims &= ~within;
+    if (delims)
+      return p + __builtin_ctzll(delims);
+    inside = (uint64_t)((int64_t)within >> 63);
+  }
+  return find_csv_scalar(p, ep, delim, inside != 0);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static inline uint64_t mask_avx2(char *p,
+                                                                 __m256i v) {
+  uint64_t lo = (uint32_t)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), v));
+  uint64_t hi = (uint32_t)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), v));
+  return lo | (hi << 32);
+}
+
+/* carry-less multiplication by all ones is the prefix xor */
+__attribute__((target("avx2,pclmul"))) static char *
+find_csv_avx2(char *p, char *ep, char delim, bool quoted) {
+  __m256i vq = _mm256_set1_epi8('\"');
+  __m256i vd = _mm256_set1_epi8(delim);
+  __m128i ones = _mm_set1_epi8((char)0xFF);
+  uint64_t inside = quoted ? ~0ULL : 0;
+  for (; p + 64 <= ep; p += 64) {
+    uint64_t quotes = mask_avx2(p, vq);
+    uint64_t delims = mask_avx2(p, vd);
+    uint64_t within = inside;
+    if (quotes)
+      within ^= (uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(
+          _mm_set_epi64x(0, (int64_t)quotes), ones, 0));
+    delims &= ~within;
+    if (delims)
+      return p + __builtin_ctzll(delims);
+    inside = (uint64_t)((int64_t)within >> 63);
+  }
+  return find_csv_sse2(p, ep, delim, inside != 0);
+}
+#endif
+
+/* runs before main (and before any threads could scan), so the pointers
+   are never written while another thread is reading them */
+__attribute__((constructor)) static void resolve_kernels(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    find_either = find_either_avx2;
+    find_csv = find_csv_sse2;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("pclmul"))
+      find_csv = find_csv_avx2;
+#endif
+  } else if (__builtin_cpu_supports("sse2")) {
+    find_either = find_either_sse2;
+    find_csv = find_csv_sse2;
+  }
+}
+#endif
+
+char *io_in_base_find_delimiter(char *p, char *ep, int delim, bool csv) {
+  /* a quote is always consumed as a quote, so it can never be found as the
+     delimiter */
+  if (delim == '\"')
+    return ep;
+
+  if (!csv)
+    return find_either(p, ep, delim, delim);
+  return find_csv(p, ep, delim, false);
+}
+
 /*
 https://en.wikipedia.org/wiki/Comma-separated_values
 
@@ -212,34 +681,17 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
   char *sp = p;
   // 2. search for delimiter between pos/used
   char *ep = b->buffer + b->used;
-  while (p < ep) {
-    if (*p == '\"') {
-       if(csv) {
-          p++;
-        encoded_quote1:
-          while(p < ep && *p != '\"')
-            p++;
-          if(p+1 < ep && p[1] == '\"') {
-            p += 2;
-            goto encoded_quote1;
-          }
-      }
-      if(p < ep)
-        p++;
-    }
-    else if (*p != delim)
-      p++;
-    else {
-      *rlen = (p - sp);
-      b->pos += (*rlen) + 1;
-      if (b->pos > b->used)
-        abort();
+  p = io_in_base_find_delimiter(p, ep, delim, csv);
+  if (p < ep) {
+    *rlen = (p - sp);
+    b->pos += (*rlen) + 1;
+    if (b->pos > b->used)
+      abort();
 
-      h->zerop = p;
-      h->zero = *p;
-      *p = 0;
-      return sp;
-    }
+    h->zerop = p;
+    h->zero = *p;
+    *p = 0;
+    return sp;
   }
 
   // 3. if finished, there is no more data to read, return what is present
@@ -257,33 +709,16 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
     // b->pos = b->used;
     fill_blocks(h, b);
     char *ep = sp + b->used;
-    while (p < ep) {
-      if (*p == '\"') {
-         if(csv) {
-            p++;
-          encoded_quote2:
-            while(p < ep && *p != '\"')
-              p++;
-            if(p+1 < ep && p[1] == '\"') {
-              p += 2;
-              goto encoded_quote2;
-            }
-        }
-        if(p < ep)
-          p++;
-      }
-      else if (*p != delim)
-        p++;
-      else {
-        *rlen = (p - sp);
-        b->pos += (*rlen) + 1;
-        if (b->pos > b->used)
-          abort();
-        h->zerop = p;
-        h->zero = *p;
-        *p = 0;
-        return sp;
-      }
+    p = io_in_base_find_delimiter(p, ep, delim, csv);
+    if (p < ep) {
+      *rlen = (p - sp);
+      b->pos += (*rlen) + 1;
+      if (b->pos > b->used)
+        abort();
+      h->zerop = p;
+      h->zero = *p;
+      *p = 0;
+      return sp;
     }
     if (b->eof) {
       b->pos = b->used;
@@ -303,32 +738,15 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
     p = b->buffer;
     sp = p;
     ep = p + b->used;
-    while (p < ep) {
-      if (*p == '\"') {
-         if(csv) {
-            p++;
-          encoded_quote3:
-            while(p < ep && *p != '\"')
-              p++;
-            if(p+1 < ep && p[1] == '\"') {
-              p += 2;
-              goto encoded_quote3;
-            }
-        }
-        if(p < ep)
-          p++;
-      }
-      else if (*p != delim)
-        p++;
-      else {
-        size_t length = (p - sp);
-        b->pos += length + 1;
-        if (b->pos > b->used)
-          abort();
-        aml_buffer_append(h->bh, b->buffer, length);
-        *rlen = aml_buffer_length(h->bh);
-        return aml_buffer_data(h->bh);
-      }
+    p = io_in_base_find_delimiter(p, ep, delim, csv);
+    if (p < ep) {
+      size_t length = (p - sp);
+      b->pos += length + 1;
+      if (b->pos > b->used)
+        abort();
+      aml_buffer_append(h->bh, b->buffer, length);
+      *rlen = aml_buffer_length(h->bh);
+      return aml_buffer_data(h->bh);
     }
     if (b->eof) {
       b->pos = b->used;
@@ -430,6 +848,9 @@ char *io_in_base_read(io_in_base_t *h, int32_t len) {
     h->zerop = NULL;
   }
 
+  if (h->map)
+    release_consumed(h);
+
   char *p = b->buffer + b->pos;
   if (b->pos + len <= b->used) {
     b->pos += len;
@@ -458,10 +879,16 @@ char *io_in_base_read(io_in_base_t *h, int32_t len) {
 }
 
 void io_in_base_destroy(io_in_base_t *h) {
+  if (h->prefetch)
+    prefetch_destroy(h->prefetch);
+  if (h->async)
+    io_async_destroy(h->async);
   if (h->bh)
     aml_buffer_destroy(h->bh);
   if (h->buf.can_free)
     aml_free(h->buf.buffer);
+  if (h->map)
+    munmap(h->map, h->map_size);
   if (h->fd != -1 && h->can_close)
     close(h->fd);
   // TODO: Support can_close properly for gz files
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "the-io-library/io_out.h"
+#include "the-io-library/io_async.h"
 
 #include "the-lz4-library/lz4.h"
 #include "a-memory-library/aml_alloc.h"
@@ -10,23 +11,21 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
-/* options for fixed output -- TODO */
-void io_out_ext_options_fixed_compare(io_out_ext_options_t *h,
-                                      io_fixed_compare_cb compare, void *arg);
-void io_out_ext_options_fixed_sort(io_out_ext_options_t *h,
-                                   io_fixed_sort_cb sort, void *arg);
-void io_out_ext_options_fixed_reducer(io_out_ext_options_t *h,
-                                      io_fixed_reducer_cb reducer, void *arg);
-
 typedef bool (*io_out_write_cb)(io_out_t *h, const void *d, size_t len);
 
+struct io_out_pool_s;
+typedef struct io_out_pool_s io_out_pool_t;
+
 const int IO_OUT_NORMAL_TYPE = 0;
 const int IO_OUT_PARTITIONED_TYPE = 1;
 const int IO_OUT_SORTED_TYPE = 2;
+const int IO_OUT_LOCAL_TYPE = 3;
 
 struct io_out_s {
   int type;
@@ -50,8 +49,14 @@ struct io_out_s {
 
   lz4_t *lz4;
 
+  io_async_t *async;
+  io_out_pool_t *pool;
+
   unsigned char delimiter;
   uint32_t fixed;
+
+  /* guards writes from thread local writers */
+  pthread_mutex_t *local_mutexes;
 };
 
 static bool _write_to_gz(gzFile *fd, const char *p, size_t len) {
@@ -102,7 +107,228 @@ static bool _write_to_fd(int *fd, const char *p, size_t len) {
   return true;
 }
 
+static bool _write_out(io_out_t *h, const char *p, size_t len) {
+  if (!h->async)
+    return _write_to_fd(&(h->fd), p, len);
+
+  if (io_async_write(h->async, p, len))
+    return true;
+  if (errno == ENOSPC) {
+    time_t cur_time = time(NULL);
+    fprintf(stderr, "%s ERROR DISK FULL %s\n", aml_file_line(),
+            ctime(&cur_time));
+  }
+  io_async_destroy(h->async);
+  h->async = NULL;
+  return false;
+}
+
+/* Compression jobs are handed to helper threads and written in the order
+   they were submitted.  Each thread has its own state (lz4_t) which is passed
+   to the compress callback. */
+typedef struct {
+  char *src;
+  size_t length;
+  char *dest;
+  size_t dest_size;
+  size_t dest_length;
+  bool done;
+} io_out_job_t;
+
+typedef size_t (*io_out_compress_cb)(void *state, const char *src,
+                                     size_t length, char *dest,
+                                     size_t dest_size);
+typedef void (*io_out_state_destroy_cb)(void *state);
+
+struct io_out_pool_s {
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  pthread_t *threads;
+  void **states;
+  size_t num_states;
+  size_t num_threads;
+  size_t started;
+  io_out_compress_cb compress;
+  io_out_state_destroy_cb destroy_state;
+
+  io_out_job_t *jobs;
+  size_t num_jobs;
+  size_t head;      // next job to write
+  size_t submitted; // next job to fill
+  size_t next;      // next job for a thread to compress
+  bool stop;
+};
+
+static void *io_out_pool_thread(void *arg) {
+  io_out_pool_t *pool = (io_out_pool_t *)arg;
+  pthread_mutex_lock(&pool->mutex);
+  void *state = pool->states[pool->started++];
+  while (true) {
+    while (!pool->stop && pool->next == pool->submitted)
+      pthread_cond_wait(&pool->work, &pool->mutex);
+    if (pool->stop)
+      break;
+    io_out_job_t *job = pool->jobs + (pool->next % pool->num_jobs);
+    pool->next++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    size_t n = pool->compress(state, job->src, job->length, job->dest,
+                              job->dest_size);
+
+    pthread_mutex_lock(&pool->mutex);
+    job->dest_length = n;
+    job->done = true;
+    pthread_cond_broadcast(&pool->finished);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static void io_out_pool_destroy(io_out_pool_t *pool);
+
+/* states must have num_threads entries and are destroyed with the pool */
+static io_out_pool_t *io_out_pool_init(io_out_compress_cb compress,
+                                       io_out_state_destroy_cb destroy_state,
+                                       void **states, size_t num_threads,
+                                       size_t src_size, size_t dest_size) {
+  size_t num_jobs = num_threads * 2;
+  io_out_pool_t *pool = (io_out_pool_t *)aml_zalloc(
+      sizeof(*pool) + (sizeof(io_out_job_t) * num_jobs) +
+      (sizeof(pthread_t) * num_threads) + (sizeof(void *) * num_threads) +
+      ((src_size + dest_size) * num_jobs));
+  pool->jobs = (io_out_job_t *)(pool + 1);
+  pool->threads = (pthread_t *)(pool->jobs + num_jobs);
+  pool->states = (void **)(pool->threads + num_threads);
+  char *p = (char *)(pool->states + num_threads);
+  for (size_t i = 0; i < num_jobs; i++) {
+    pool->jobs[i].src = p;
+    p += src_size;
+    pool->jobs[i].dest = p;
+    pool->jobs[i].dest_size = dest_size;
+    p += dest_size;
+  }
+  memcpy(pool->states, states, sizeof(void *) * num_threads);
+  pool->num_states = num_threads;
+  pool->num_jobs = num_jobs;
+  pool->compress = compress;
+  pool->destroy_state = destroy_state;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    if (pthread_create(pool->threads + i, NULL, io_out_pool_thread, pool))
+      break;
+    pool->num_threads++;
+  }
+  if (!pool->num_threads) {
+    io_out_pool_destroy(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+static void io_out_pool_destroy(io_out_pool_t *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+  for (size_t i = 0; i < pool->num_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+  for (size_t i = 0; i < pool->num_states; i++)
+    pool->destroy_state(pool->states[i]);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->finished);
+  aml_free(pool);
+}
+
+/* returns the oldest job once it is compressed */
+static io_out_job_t *io_out_pool_wait(io_out_pool_t *pool) {
+  io_out_job_t *job = pool->jobs + (pool->head % pool->num_jobs);
+  pthread_mutex_lock(&pool->mutex);
+  while (!job->done)
+    pthread_cond_wait(&pool->finished, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+  pool->head++;
+  return job;
+}
+
+/* the caller must first make room (head + num_jobs > submitted) */
+static void io_out_pool_submit(io_out_pool_t *pool, const char *p,
+                               size_t len) {
+  io_out_job_t *job = pool->jobs + (pool->submitted % pool->num_jobs);
+  memcpy(job->src, p, len);
+  job->length = len;
+  job->done = false;
+  pthread_mutex_lock(&pool->mutex);
+  pool->submitted++;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static inline bool io_out_pool_full(io_out_pool_t *pool) {
+  return pool->submitted - pool->head == pool->num_jobs;
+}
+
+static inline bool io_out_pool_empty(io_out_pool_t *pool) {
+  return pool->submitted == pool->head;
+}
+
+static size_t _lz4_compress(void *state, const char *src, size_t length,
+                            char *dest, size_t dest_size) {
+  return lz4_compress_block((lz4_t *)state, src, length, dest, dest_size);
+}
+
+static void _lz4_destroy(void *state) { lz4_destroy((lz4_t *)state); }
+
+/* copy a compressed block into buffer2, writing buffer2 out when it is full */
+static bool _write_lz4_block(io_out_t *h, const char *p, size_t len) {
+  if (h->buffer_pos2 + len > h->buffer_size2) {
+    if (!_write_out(h, h->buffer2, h->buffer_pos2)) {
+      if (h->fd_owner)
+        close(h->fd);
+      h->fd = -1;
+      return false;
+    }
+    h->buffer_pos2 = 0;
+  }
+  memcpy(h->buffer2 + h->buffer_pos2, p, len);
+  h->buffer_pos2 += len;
+  return true;
+}
+
+/* blocks are compressed by the pool, a zero length waits for every block and
+   writes out buffer2 */
+static bool _write_to_lz4_pool(io_out_t *h, const char *p, size_t len) {
+  io_out_pool_t *pool = h->pool;
+  if (len) {
+    if (io_out_pool_full(pool)) {
+      io_out_job_t *job = io_out_pool_wait(pool);
+      if (!_write_lz4_block(h, job->dest, job->dest_length))
+        return false;
+    }
+    io_out_pool_submit(pool, p, len);
+    return true;
+  }
+  while (!io_out_pool_empty(pool)) {
+    io_out_job_t *job = io_out_pool_wait(pool);
+    if (!_write_lz4_block(h, job->dest, job->dest_length))
+      return false;
+  }
+  if (!_write_out(h, h->buffer2, h->buffer_pos2)) {
+    if (h->fd_owner)
+      close(h->fd);
+    h->fd = -1;
+    return false;
+  }
+  h->buffer_pos2 = 0;
+  return true;
+}
+
 static bool _write_to_lz4(io_out_t *h, const char *p, size_t len) {
+  if (h->pool)
+    return _write_to_lz4_pool(h, p, len);
 start:;
   bool written = true;
   if (len) {
@@ -119,7 +345,7 @@ start:;
       written = true;
     }
   }
-  if (!_write_to_fd(&(h->fd), h->buffer2, h->buffer_pos2)) {
+  if (!_write_out(h, h->buffer2, h->buffer_pos2)) {
     if (h->fd_owner)
       close(h->fd);
     h->fd = -1;
@@ -141,7 +367,7 @@ static bool _io_out_write(io_out_t *h, const void *d, size_t len) {
     if (len)
       return true;
     else {
-      if (!_write_to_fd(&(h->fd), h->buffer, h->buffer_pos)) {
+      if (!_write_out(h, h->buffer, h->buffer_pos)) {
         if (h->fd_owner)
           close(h->fd);
         h->fd = -1;
@@ -154,7 +380,7 @@ static bool _io_out_write(io_out_t *h, const void *d, size_t len) {
   size_t diff = h->buffer_size - h->buffer_pos;
   memcpy(h->buffer + h->buffer_pos, d, diff);
   h->buffer_pos += diff;
-  if (!_write_to_fd(&(h->fd), h->buffer, h->buffer_pos)) {
+  if (!_write_out(h, h->buffer, h->buffer_pos)) {
     if (h->fd_owner)
       close(h->fd);
     h->fd = -1;
@@ -165,7 +391,7 @@ static bool _io_out_write(io_out_t *h, const void *d, size_t len) {
   len -= diff;
   h->buffer_pos = 0;
   if (len >= h->buffer_size) {
-    if (!_write_to_fd(&(h->fd), p, len)) {
+    if (!_write_out(h, p, len)) {
       if (h->fd_owner)
         close(h->fd);
       h->fd = -1;
@@ -190,6 +416,8 @@ static bool _io_out_write_lz4(io_out_t *h, const void *d, size_t len) {
     else {
       if (!_write_to_lz4(h, h->buffer, h->buffer_pos))
         return false;
+      if (h->pool && !_write_to_lz4(h, NULL, 0))
+        return false;
       h->buffer_pos = 0;
       char *wp = h->buffer2 + h->buffer_pos2;
       uint32_t n = lz4_finish(h->lz4, wp);
@@ -221,6 +449,115 @@ static bool _io_out_write_lz4(io_out_t *h, const void *d, size_t len) {
   return true;
 }
 
+/* When gzip output is threaded, every chunk is compressed as its own gzip
+   member (gunzip and gzread concatenate members).  BGZF members carry their
+   compressed size in a 'BC' extra field and hold at most 65280 bytes so that
+   readers can seek to or split on member boundaries. */
+static const size_t BGZF_BLOCK_SIZE = 65280;
+static const size_t BGZF_MAX_BLOCK_SIZE = 65536;
+
+static const unsigned char gzip_header[10] = {0x1f, 0x8b, 8, 0, 0,
+                                              0,    0,    0, 0, 3};
+/* the OS byte is 0xff (unknown) as in the SAM/BAM spec */
+static const unsigned char bgzf_header[18] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0};
+/* an empty BGZF block marks the end of the file, readers such as htslib
+   compare it byte for byte */
+static const unsigned char bgzf_eof[28] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C',
+    2,    0,    0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+typedef struct {
+  z_stream zs;
+  bool bgzf;
+} io_out_gz_state_t;
+
+static inline void _put_le32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+static size_t _gz_compress(void *state, const char *src, size_t length,
+                           char *dest, size_t dest_size) {
+  io_out_gz_state_t *gs = (io_out_gz_state_t *)state;
+  unsigned char *d = (unsigned char *)dest;
+  size_t header_size = gs->bgzf ? sizeof(bgzf_header) : sizeof(gzip_header);
+  memcpy(d, gs->bgzf ? bgzf_header : gzip_header, header_size);
+
+  size_t avail = dest_size - header_size - 8;
+  z_stream *zs = &gs->zs;
+  if (deflateReset(zs) != Z_OK)
+    return 0;
+  zs->next_in = (Bytef *)src;
+  zs->avail_in = length;
+  zs->next_out = d + header_size;
+  zs->avail_out = avail;
+  size_t n;
+  if (deflate(zs, Z_FINISH) == Z_STREAM_END)
+    n = zs->total_out;
+  else {
+    /* a single stored block (only needed when a bgzf block doesn't shrink) */
+    if (length > 0xFFFF || length + 5 > avail)
+      return 0;
+    unsigned char *p = d + header_size;
+    p[0] = 1;
+    p[1] = length & 0xFF;
+    p[2] = length >> 8;
+    p[3] = ~p[1];
+    p[4] = ~p[2];
+    memcpy(p + 5, src, length);
+    n = length + 5;
+  }
+  unsigned char *p = d + header_size + n;
+  _put_le32(p, crc32(0, (const Bytef *)src, length));
+  _put_le32(p + 4, length);
+  n += header_size + 8;
+  if (gs->bgzf) {
+    d[16] = (n - 1) & 0xFF;
+    d[17] = (n - 1) >> 8;
+  }
+  return n;
+}
+
+static void _gz_destroy(void *state) {
+  io_out_gz_state_t *gs = (io_out_gz_state_t *)state;
+  deflateEnd(&gs->zs);
+  aml_free(gs);
+}
+
+/* same as _write_to_lz4_pool, except that members are written directly */
+static bool _write_to_gz_pool(io_out_t *h, const char *p, size_t len) {
+  io_out_pool_t *pool = h->pool;
+  if (len) {
+    if (!io_out_pool_full(pool)) {
+      io_out_pool_submit(pool, p, len);
+      return true;
+    }
+  } else if (io_out_pool_empty(pool))
+    return true;
+
+  do {
+    io_out_job_t *job = io_out_pool_wait(pool);
+    if (!job->dest_length || !_write_out(h, job->dest, job->dest_length)) {
+      if (h->fd_owner)
+        close(h->fd);
+      h->fd = -1;
+      return false;
+    }
+  } while (!len && !io_out_pool_empty(pool));
+  if (len)
+    io_out_pool_submit(pool, p, len);
+  return true;
+}
+
+static inline bool _write_gz(io_out_t *h, const char *p, size_t len) {
+  if (h->pool)
+    return _write_to_gz_pool(h, p, len);
+  return _write_to_gz(&(h->gz), p, len);
+}
+
 static bool _io_out_write_gz(io_out_t *h, const void *d, size_t len) {
   if (h->buffer_pos + len < h->buffer_size) {
     memcpy(h->buffer + h->buffer_pos, d, len);
@@ -228,7 +565,9 @@ static bool _io_out_write_gz(io_out_t *h, const void *d, size_t len) {
     if (len)
       return true;
     else {
-      if (!_write_to_gz(&(h->gz), h->buffer, h->buffer_pos))
+      if (!_write_gz(h, h->buffer, h->buffer_pos))
+        return false;
+      if (h->pool && !_write_to_gz_pool(h, NULL, 0))
         return false;
       h->buffer_pos = 0;
       return true;
@@ -237,14 +576,14 @@ static bool _io_out_write_gz(io_out_t *h, const void *d, size_t len) {
   size_t diff = h->buffer_size - h->buffer_pos;
   memcpy(h->buffer + h->buffer_pos, d, diff);
   h->buffer_pos += diff;
-  if (!_write_to_gz(&(h->gz), h->buffer, h->buffer_pos))
+  if (!_write_gz(h, h->buffer, h->buffer_pos))
     return false;
   char *p = (char *)d;
   p += diff;
   len -= diff;
   h->buffer_pos = 0;
   while (len >= h->buffer_size) {
-    if (!_write_to_gz(&(h->gz), p, h->buffer_size))
+    if (!_write_gz(h, p, h->buffer_size))
       return false;
     len -= h->buffer_size;
     p += h->buffer_size;
@@ -321,13 +660,29 @@ static io_out_t *_io_out_init_lz4(const char *filename, int fd, bool fd_owner,
     strcat(tmp, "-safe.lz4");
   }
 
-  if (h->fd == -1)
+  h->fd_owner = fd_owner;
+  if (h->fd == -1) {
     h->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (options->async)
+      h->async = io_async_writer_init(h->fd, buffer_size);
+  }
   uint32_t header_size = 0;
   const char *header = lz4_get_header(lz4, &header_size);
 
   memcpy(h->buffer2, header, header_size);
   h->buffer_pos2 = header_size;
+
+  /* the content checksum must see blocks in order */
+  if (options->lz4_threads && !options->content_checksum) {
+    void **states = (void **)aml_malloc(sizeof(void *) * options->lz4_threads);
+    for (size_t i = 0; i < options->lz4_threads; i++)
+      states[i] = lz4_init(options->level, options->size,
+                           options->block_checksum, false);
+    h->pool = io_out_pool_init(_lz4_compress, _lz4_destroy, states,
+                               options->lz4_threads, block_size,
+                               lz4_compress_bound(block_size) + 8);
+    aml_free(states);
+  }
   h->options = *options;
   h->write_d = _io_out_write_lz4;
   return h;
@@ -337,8 +692,13 @@ static io_out_t *_io_out_init_gz(const char *filename, int fd, bool fd_owner,
                                  io_out_options_t *options) {
   size_t buffer_size = options->buffer_size;
   bool append_mode = options->append_mode;
+  bool threaded = options->gz_threads || options->bgzf;
 
-  if (buffer_size < (64 * 1024))
+  if (options->bgzf)
+    buffer_size = BGZF_BLOCK_SIZE;
+  else if (threaded && buffer_size < (256 * 1024))
+    buffer_size = 256 * 1024;
+  else if (buffer_size < (64 * 1024))
     buffer_size = 64 * 1024;
 
   int filename_length = filename ? strlen(filename) + 1 : 0;
@@ -370,6 +730,39 @@ static io_out_t *_io_out_init_gz(const char *filename, int fd, bool fd_owner,
     strcat(tmp, "-safe.gz");
   }
 
+  if (threaded) {
+    size_t num_threads = options->gz_threads ? options->gz_threads : 1;
+    void **states = (void **)aml_malloc(sizeof(void *) * num_threads);
+    for (size_t i = 0; i < num_threads; i++) {
+      io_out_gz_state_t *gs =
+          (io_out_gz_state_t *)aml_zalloc(sizeof(io_out_gz_state_t));
+      gs->bgzf = options->bgzf;
+      deflateInit2(&gs->zs, options->level, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY);
+      states[i] = gs;
+    }
+    size_t dest_size = options->bgzf ? BGZF_MAX_BLOCK_SIZE
+                                     : compressBound(buffer_size) +
+                                           sizeof(bgzf_header) + 8;
+    h->pool = io_out_pool_init(_gz_compress, _gz_destroy, states, num_threads,
+                               buffer_size, dest_size);
+    aml_free(states);
+    if (h->pool) {
+      h->fd_owner = fd_owner;
+      if (fd != -1)
+        h->fd = fd;
+      else if (append_mode)
+        h->fd = open(tmp, O_WRONLY | O_CREAT | O_APPEND, 0777);
+      else {
+        h->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+        if (options->async)
+          h->async = io_async_writer_init(h->fd, buffer_size * 4);
+      }
+      h->write_d = _io_out_write_gz;
+      return h;
+    }
+  }
+
   char mode[3];
   mode[0] = append_mode ? 'a' : 'w';
   mode[1] = options->level + '0';
@@ -413,6 +806,7 @@ static io_out_t *_io_out_init(const char *filename, int fd, bool fd_owner,
     strcat(tmp, "-safe");
   }
 
+  h->fd_owner = fd_owner;
   if (fd != -1)
     h->fd = fd;
   else if (append_mode)
@@ -422,6 +816,8 @@ static io_out_t *_io_out_init(const char *filename, int fd, bool fd_owner,
     if (h->fd == -1) {
       perror("Unable to open file\n");
     }
+    if (options->async)
+      h->async = io_async_writer_init(h->fd, buffer_size);
   }
   h->write_d = _io_out_write;
   return h;
@@ -469,6 +865,12 @@ void io_out_options_gz(io_out_options_t *h, int level) {
   h->level = level;
 }
 
+void io_out_options_gz_threads(io_out_options_t *h, size_t num_threads) {
+  h->gz_threads = num_threads;
+}
+
+void io_out_options_gz_bgzf(io_out_options_t *h) { h->bgzf = true; }
+
 void io_out_options_lz4(io_out_options_t *h, int level,
                         lz4_block_size_t size, bool block_checksum,
                         bool content_checksum) {
@@ -479,6 +881,12 @@ void io_out_options_lz4(io_out_options_t *h, int level,
   h->content_checksum = content_checksum;
 }
 
+void io_out_options_lz4_threads(io_out_options_t *h, size_t num_threads) {
+  h->lz4_threads = num_threads;
+}
+
+void io_out_options_async(io_out_options_t *h) { h->async = true; }
+
 void io_out_ext_options_init(io_out_ext_options_t *h) {
   memset(h, 0, sizeof(*h));
   // h->lz4_tmp = false;
@@ -494,6 +902,42 @@ void io_out_ext_options_num_sort_threads(io_out_ext_options_t *h,
   h->num_sort_threads = num_sort_threads;
 }
 
+void io_out_ext_options_sort_threads(io_out_ext_options_t *h,
+                                     size_t sort_threads) {
+  h->sort_threads = sort_threads;
+}
+
+void io_out_ext_options_max_fan_in(io_out_ext_options_t *h,
+                                   size_t max_fan_in) {
+  h->max_fan_in = max_fan_in;
+}
+
+void io_out_ext_options_merge_threads(io_out_ext_options_t *h,
+                                      size_t merge_threads) {
+  h->merge_threads = merge_threads;
+}
+
+void io_out_ext_options_tmp_dirs(io_out_ext_options_t *h, char **dirs,
+                                 size_t num_dirs) {
+  h->tmp_dirs = dirs;
+  h->num_tmp_dirs = num_dirs;
+}
+
+void io_out_ext_options_combiner(io_out_ext_options_t *h, io_hash_cb hash,
+                                 void *arg) {
+  h->combiner = true;
+  h->combiner_hash = hash ? hash : io_hash_record;
+  h->combiner_hash_arg = arg;
+}
+
+void io_out_ext_options_limit(io_out_ext_options_t *h, size_t limit) {
+  h->limit = limit;
+}
+
+void io_out_ext_options_replacement_selection(io_out_ext_options_t *h) {
+  h->replacement_selection = true;
+}
+
 void io_out_ext_options_sort_before_partitioning(io_out_ext_options_t *h) {
   h->sort_before_partitioning = true;
 }
@@ -513,6 +957,29 @@ void io_out_ext_options_partition(io_out_ext_options_t *h,
   h->partition_arg = arg;
 }
 
+static size_t _range_partition(const io_record_t *r, size_t num_part,
+                               void *arg);
+
+void io_out_ext_options_range_partition(io_out_ext_options_t *h,
+                                        size_t sample_size) {
+  h->partition = _range_partition;
+  h->partition_arg = NULL;
+  h->range_sample_size = sample_size;
+}
+
+void io_out_ext_options_range_sample_file(io_out_ext_options_t *h,
+                                          const char *filename,
+                                          io_format_t format) {
+  h->partition = _range_partition;
+  h->partition_arg = NULL;
+  h->range_sample_file = filename;
+  h->range_sample_format = format;
+}
+
+void io_out_ext_options_bucketed_spill(io_out_ext_options_t *h) {
+  h->bucketed_spill = true;
+}
+
 void io_out_ext_options_num_partitions(io_out_ext_options_t *h,
                                        size_t num_partitions) {
   h->num_partitions = num_partitions;
@@ -537,7 +1004,18 @@ void io_out_ext_options_intermediate_compare(io_out_ext_options_t *h,
   h->int_compare_arg = arg;
 }
 
+void io_out_ext_options_key_prefix(io_out_ext_options_t *h,
+                                   io_key_prefix_cb key_prefix, void *arg) {
+  h->key_prefix = key_prefix;
+  h->key_prefix_arg = arg;
+}
+
+void io_out_ext_options_radix_sort(io_out_ext_options_t *h, io_radix_t radix) {
+  h->radix = radix;
+}
+
 /* set the reducer */
+
 void io_out_ext_options_reducer(io_out_ext_options_t *h,
                                 io_reducer_cb reducer, void *arg) {
   h->reducer = reducer;
@@ -698,8 +1176,33 @@ static bool io_out_flush(io_out_t *h) {
 
 static void io_out_ext_destroy(io_out_t *hp);
 
+static void destroy_local_mutexes(pthread_mutex_t *mutexes, size_t num) {
+  if (!mutexes)
+    return;
+  for (size_t i = 0; i < num; i++)
+    pthread_mutex_destroy(mutexes + i);
+  aml_free(mutexes);
+}
+
 void _io_out_destroy(io_out_t *h) {
+  destroy_local_mutexes(h->local_mutexes, 1);
+  h->local_mutexes = NULL;
   io_out_flush(h);
+  if (h->pool) {
+    if (h->options.bgzf && h->fd > -1)
+      _write_out(h, (const char *)bgzf_eof, sizeof(bgzf_eof));
+    io_out_pool_destroy(h->pool);
+    h->pool = NULL;
+  }
+  if (h->async) {
+    if (!io_async_flush(h->async) && errno == ENOSPC) {
+      time_t cur_time = time(NULL);
+      fprintf(stderr, "%s ERROR DISK FULL %s\n", aml_file_line(),
+              ctime(&cur_time));
+    }
+    io_async_destroy(h->async);
+    h->async = NULL;
+  }
   if (h->fd > -1 && h->fd_owner) {
     close(h->fd);
     h->fd = -1;
@@ -795,7 +1298,91 @@ void io_out_partition_filename(char *dest, const char *filename, size_t id) {
   suffix_filename_with_id(dest, strlen(filename) + 20, filename, id, NULL, false);
 }
 
+/* The tmp dirs are copied to p (which must be aligned for a pointer) so
+   that the caller's dirs only need to be valid until the output is
+   initialized.  tmp_dirs_size returns the space needed and the length of
+   the longest directory. */
+static size_t tmp_dirs_size(io_out_ext_options_t *o, size_t *max_len) {
+  size_t size = sizeof(char *) * o->num_tmp_dirs;
+  *max_len = 0;
+  for (size_t i = 0; i < o->num_tmp_dirs; i++) {
+    size_t len = strlen(o->tmp_dirs[i]);
+    if (len > *max_len)
+      *max_len = len;
+    size += len + 1;
+  }
+  return size;
+}
+
+static char *copy_tmp_dirs(io_out_ext_options_t *o, char *p) {
+  char **dirs = (char **)p;
+  p += sizeof(char *) * o->num_tmp_dirs;
+  for (size_t i = 0; i < o->num_tmp_dirs; i++) {
+    dirs[i] = p;
+    strcpy(p, o->tmp_dirs[i]);
+    p += strlen(p) + 1;
+  }
+  o->tmp_dirs = dirs;
+  return p;
+}
+
+/* tmp files are assigned to the tmp dirs round robin, starting at a dir
+   chosen by the filename so that outputs written at the same time (such as
+   partitions) start on different dirs */
+static const char *tmp_dir(io_out_ext_options_t *o, const char *filename,
+                           size_t n) {
+  size_t offset = io_hash_filename(filename) % o->num_tmp_dirs;
+  return o->tmp_dirs[(offset + n) % o->num_tmp_dirs];
+}
+
+static const char *base_filename(const char *filename) {
+  const char *p = strrchr(filename, '/');
+  return p ? p + 1 : filename;
+}
+
+static size_t sorted_in_memory(io_out_t *hp);
+static void sorted_spill(io_out_t *hp);
+
+/* the records of a partition written to the spill file at offset */
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+  size_t partition;
+} io_out_block_t;
+
+typedef struct {
+  int fd;
+  io_out_block_t *bp;
+  io_out_block_t *ep;
+} io_out_block_reader_t;
+
 /** io_out_partitioned_t **/
+/* Threads which have no partitions left to sort are counted here and the
+   sorted writers of the remaining partitions take them as extra sort or
+   merge threads (and give them back when the sort or merge pass ends). */
+typedef struct io_out_spare_threads_s {
+  pthread_mutex_t mutex;
+  size_t num_threads;
+} io_out_spare_threads_t;
+
+static size_t take_spare_threads(io_out_spare_threads_t *s, size_t wanted) {
+  if (!s || !wanted)
+    return 0;
+  pthread_mutex_lock(&s->mutex);
+  size_t n = s->num_threads < wanted ? s->num_threads : wanted;
+  s->num_threads -= n;
+  pthread_mutex_unlock(&s->mutex);
+  return n;
+}
+
+static void give_spare_threads(io_out_spare_threads_t *s, size_t n) {
+  if (!s || !n)
+    return;
+  pthread_mutex_lock(&s->mutex);
+  s->num_threads += n;
+  pthread_mutex_unlock(&s->mutex);
+}
+
 typedef struct {
   int type;
   io_out_options_t options;
@@ -819,8 +1406,82 @@ typedef struct {
   size_t *taskp;
   size_t *taskep;
   pthread_mutex_t mutex;
+
+  /* partitions are sorted largest first (by their unsorted size), each
+     with a share of sort_memory and of the threads which aren't busy */
+  size_t *sizes;
+  size_t num_threads;
+  size_t busy_threads;
+  size_t sort_memory;
+  size_t sort_memory_used;
+  io_out_spare_threads_t spare;
+
+  size_t tmp_name_len;
+
+  /* range partitioning holds the sample (length prefixed records) until
+     the splitters are chosen */
+  aml_buffer_t *sample_bh;
+  size_t num_sampled;
+  io_record_t *splitters;
+  size_t num_splitters;
+
+  /* io_out_in keeps a cursor for each partition (until it is merged or
+     concatenated) and the sorted partitions which are kept in memory use
+     at most max_memory bytes */
+  io_in_t **ins;
+  size_t cur_in;
+  size_t memory;
+  size_t max_memory;
+
+  /* thread local writers lock a partition to write to it (and the last
+     mutex while the sample is being taken) */
+  pthread_mutex_t *local_mutexes;
+
+  /* a bucketed spill holds the records (after their partition) in
+     spill_bh and writes them to one spill file as a block per partition.
+     Once the spill is finished, the blocks are ordered by partition and
+     block_index[id] is the first block of partition id. */
+  bool bucketed;
+  io_out_write_cb route_record;
+  aml_buffer_t *spill_bh;
+  size_t num_spilled;
+  aml_buffer_t *order_bh;
+  size_t *counts;
+  io_out_t *spill_out;
+  uint64_t spill_offset;
+  aml_buffer_t *blocks_bh;
+  int spill_fd;
+  io_out_block_t *blocks;
+  size_t *block_index;
+  io_out_block_reader_t *readers;
 } io_out_partitioned_t;
 
+static void unsorted_filename(io_out_partitioned_t *h, char *dest,
+                              size_t id) {
+  bool lz4_tmp = h->ext_options.lz4_tmp;
+  if (!h->ext_options.num_tmp_dirs) {
+    suffix_filename_with_id(dest, h->tmp_name_len, h->filename, id,
+                            "unsorted", lz4_tmp);
+    return;
+  }
+  const char *dir = tmp_dir(&(h->ext_options), h->filename, id);
+  int n = snprintf(dest, h->tmp_name_len, "%s/", dir);
+  suffix_filename_with_id(dest + n, h->tmp_name_len - n,
+                          base_filename(h->filename), id, "unsorted",
+                          lz4_tmp);
+}
+
+/* the spill file doesn't keep the extension so that it isn't compressed */
+static void spill_filename(io_out_partitioned_t *h, char *dest) {
+  if (!h->ext_options.num_tmp_dirs) {
+    snprintf(dest, h->tmp_name_len, "%s_spill", h->filename);
+    return;
+  }
+  snprintf(dest, h->tmp_name_len, "%s/%s_spill",
+           tmp_dir(&(h->ext_options), h->filename, 0),
+           base_filename(h->filename));
+}
+
 bool write_partitioned_record(io_out_t *hp, const void *d, size_t len) {
   io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
 
@@ -837,6 +1498,301 @@ bool write_partitioned_record(io_out_t *hp, const void *d, size_t len) {
   return o->write_record(o, d, len);
 }
 
+/* write the held records to the spill file as a block per partition */
+static void spill_buckets(io_out_partitioned_t *h) {
+  size_t num_records = h->num_spilled;
+  if (!num_records)
+    return;
+
+  /* a counting sort of the record offsets by partition */
+  size_t num_partitions = h->num_partitions;
+  aml_buffer_resize(h->order_bh, sizeof(size_t) * num_records);
+  size_t *order = (size_t *)aml_buffer_data(h->order_bh);
+  size_t *counts = h->counts;
+  memset(counts, 0, sizeof(size_t) * num_partitions);
+  char *base = aml_buffer_data(h->spill_bh);
+  char *p = base;
+  uint32_t header[2];
+  for (size_t i = 0; i < num_records; i++) {
+    memcpy(header, p, sizeof(header));
+    counts[header[0]]++;
+    p += sizeof(header) + header[1];
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < num_partitions; i++) {
+    size_t n = counts[i];
+    counts[i] = offset;
+    offset += n;
+  }
+  p = base;
+  for (size_t i = 0; i < num_records; i++) {
+    memcpy(header, p, sizeof(header));
+    order[counts[header[0]]++] = p - base;
+    p += sizeof(header) + header[1];
+  }
+
+  /* counts[i] is now the end of partition i */
+  size_t *op = order;
+  for (size_t i = 0; i < num_partitions; i++) {
+    size_t *ep = order + counts[i];
+    if (op == ep)
+      continue;
+    io_out_block_t block;
+    block.offset = h->spill_offset;
+    block.partition = i;
+    for (; op < ep; op++) {
+      p = base + *op;
+      memcpy(header, p, sizeof(header));
+      io_out_write_record(h->spill_out, p + sizeof(header), header[1]);
+      h->spill_offset += sizeof(uint32_t) + header[1];
+    }
+    block.length = h->spill_offset - block.offset;
+    aml_buffer_append(h->blocks_bh, &block, sizeof(block));
+  }
+  aml_buffer_clear(h->spill_bh);
+  h->num_spilled = 0;
+}
+
+static bool write_bucketed_record(io_out_t *hp, const void *d, size_t len) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+  if (len > 0xffffffffU)
+    return false;
+
+  io_record_t r;
+  r.length = len;
+  r.record = (char *)d;
+  r.tag = 0;
+
+  size_t partition = h->partition(&r, h->num_partitions, h->partition_arg);
+  if (partition >= h->num_partitions)
+    return false;
+
+  uint32_t header[2] = {partition, len};
+  if (aml_buffer_length(h->spill_bh) + sizeof(header) + len >
+      h->options.buffer_size)
+    spill_buckets(h);
+  aml_buffer_append(h->spill_bh, header, sizeof(header));
+  aml_buffer_append(h->spill_bh, d, len);
+  h->num_spilled++;
+  return true;
+}
+
+/* order the blocks by partition and open the spill file to read them */
+static void finish_spill(io_out_partitioned_t *h) {
+  spill_buckets(h);
+  io_out_destroy(h->spill_out);
+  h->spill_out = NULL;
+  aml_buffer_destroy(h->spill_bh);
+  h->spill_bh = NULL;
+  aml_buffer_destroy(h->order_bh);
+  h->order_bh = NULL;
+
+  size_t num_partitions = h->num_partitions;
+  io_out_block_t *blocks = (io_out_block_t *)aml_buffer_data(h->blocks_bh);
+  size_t num_blocks = aml_buffer_length(h->blocks_bh) / sizeof(*blocks);
+  h->block_index =
+      (size_t *)aml_zalloc(sizeof(size_t) * (num_partitions + 1));
+  for (size_t i = 0; i < num_blocks; i++)
+    h->block_index[blocks[i].partition + 1]++;
+  for (size_t i = 0; i < num_partitions; i++)
+    h->block_index[i + 1] += h->block_index[i];
+  memcpy(h->counts, h->block_index, sizeof(size_t) * num_partitions);
+  h->blocks = (io_out_block_t *)aml_malloc(sizeof(*blocks) * (num_blocks + 1));
+  for (size_t i = 0; i < num_blocks; i++)
+    h->blocks[h->counts[blocks[i].partition]++] = blocks[i];
+  aml_buffer_destroy(h->blocks_bh);
+  h->blocks_bh = NULL;
+
+  h->readers = (io_out_block_reader_t *)aml_malloc(
+      sizeof(io_out_block_reader_t) * num_partitions);
+  char *tmp_name = (char *)aml_malloc(h->tmp_name_len);
+  spill_filename(h, tmp_name);
+  h->spill_fd = open(tmp_name, O_RDONLY);
+  aml_free(tmp_name);
+}
+
+static io_in_t *next_block_in(void *arg) {
+  io_out_block_reader_t *r = (io_out_block_reader_t *)arg;
+  if (r->bp >= r->ep)
+    return NULL;
+  io_out_block_t *b = r->bp;
+  r->bp++;
+  char *buffer = (char *)aml_malloc(b->length + 1);
+  size_t pos = 0;
+  while (pos < b->length) {
+    ssize_t n = pread(r->fd, buffer + pos, b->length - pos, b->offset + pos);
+    if (n > 0)
+      pos += n;
+    else if (n == 0 || errno != EINTR) {
+      /* the spill file was written by this process, so a short block means
+         records would be lost */
+      fprintf(stderr, "%s ERROR reading spill block: %s\n", aml_file_line(),
+              n == 0 ? "unexpected end of file" : strerror(errno));
+      abort();
+    }
+  }
+  io_in_options_t opts;
+  io_in_options_init(&opts);
+  io_in_options_format(&opts, io_prefix());
+  return io_in_init_with_buffer(buffer, pos, true, &opts);
+}
+
+/* a cursor over the blocks of partition id (NULL if there are none) */
+static io_in_t *spill_in(io_out_partitioned_t *h, size_t id) {
+  io_out_block_reader_t *r = h->readers + id;
+  r->fd = h->spill_fd;
+  r->bp = h->blocks + h->block_index[id];
+  r->ep = h->blocks + h->block_index[id + 1];
+  return io_in_init_from_cb(next_block_in, r);
+}
+
+/* the size of the unsorted partition id */
+static size_t unsorted_size(io_out_partitioned_t *h, size_t id,
+                            char *tmp_name) {
+  if (!h->bucketed) {
+    unsorted_filename(h, tmp_name, id);
+    return io_file_size(tmp_name);
+  }
+  size_t size = 0;
+  for (size_t i = h->block_index[id]; i < h->block_index[id + 1]; i++)
+    size += h->blocks[i].length;
+  return size;
+}
+
+static void destroy_spill(io_out_partitioned_t *h) {
+  aml_free(h->counts);
+  aml_free(h->blocks);
+  aml_free(h->block_index);
+  aml_free(h->readers);
+}
+
+/* remove the unsorted partitions (or the spill file) */
+static void remove_unsorted(io_out_partitioned_t *h) {
+  char *tmp_name = (char *)aml_malloc(h->tmp_name_len);
+  if (h->bucketed) {
+    if (h->spill_fd > -1)
+      close(h->spill_fd);
+    h->spill_fd = -1;
+    spill_filename(h, tmp_name);
+    remove(tmp_name);
+  } else {
+    for (size_t i = 0; i < h->num_partitions; i++) {
+      unsorted_filename(h, tmp_name, i);
+      remove(tmp_name);
+    }
+  }
+  aml_free(tmp_name);
+}
+
+/* the partition after the last splitter which is not greater than r */
+static size_t _range_partition(const io_record_t *r, size_t num_part,
+                               void *arg) {
+  (void)num_part;
+  io_out_partitioned_t *h = (io_out_partitioned_t *)arg;
+  io_compare_cb compare = h->ext_options.compare;
+  void *compare_arg = h->ext_options.compare_arg;
+  size_t lo = 0, hi = h->num_splitters;
+  while (lo < hi) {
+    size_t mid = lo + ((hi - lo) >> 1);
+    if (compare(h->splitters + mid, r, compare_arg) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* records from sample_bh */
+static io_record_t *sampled_records(io_out_partitioned_t *h) {
+  io_record_t *r =
+      (io_record_t *)aml_malloc(sizeof(io_record_t) * (h->num_sampled + 1));
+  char *p = aml_buffer_data(h->sample_bh);
+  for (size_t i = 0; i < h->num_sampled; i++) {
+    memcpy(&(r[i].length), p, sizeof(r[i].length));
+    p += sizeof(r[i].length);
+    r[i].record = p;
+    r[i].tag = 0;
+    p += r[i].length;
+  }
+  return r;
+}
+
+/* sort the sample and copy evenly spaced records as the splitters */
+static void choose_splitters(io_out_partitioned_t *h) {
+  io_record_t *r = sampled_records(h);
+  size_t n = h->num_sampled;
+  io_sort_records(r, n, h->ext_options.compare, h->ext_options.compare_arg);
+
+  size_t num_splitters = n ? h->num_partitions - 1 : 0;
+  size_t size = sizeof(io_record_t) * num_splitters;
+  for (size_t i = 0; i < num_splitters; i++)
+    size += r[((i + 1) * n) / h->num_partitions].length + 1;
+  h->splitters = (io_record_t *)aml_malloc(size + 1);
+  h->num_splitters = num_splitters;
+  char *p = (char *)(h->splitters + num_splitters);
+  for (size_t i = 0; i < num_splitters; i++) {
+    io_record_t *s = r + ((i + 1) * n) / h->num_partitions;
+    memcpy(p, s->record, s->length);
+    p[s->length] = 0;
+    h->splitters[i].record = p;
+    h->splitters[i].length = s->length;
+    h->splitters[i].tag = 0;
+    p += s->length + 1;
+  }
+  aml_free(r);
+}
+
+/* choose the splitters and write the records which were held */
+static bool finish_sample(io_out_partitioned_t *h, bool write_sample) {
+  choose_splitters(h);
+  h->write_record = h->route_record;
+  bool ok = true;
+  if (write_sample) {
+    io_record_t *r = sampled_records(h);
+    for (size_t i = 0; i < h->num_sampled; i++)
+      if (!h->route_record((io_out_t *)h, r[i].record, r[i].length))
+        ok = false;
+    aml_free(r);
+  }
+  aml_buffer_destroy(h->sample_bh);
+  h->sample_bh = NULL;
+  return ok;
+}
+
+static bool write_sampled_record(io_out_t *hp, const void *d, size_t len) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+  if (len > 0xffffffffU)
+    return false;
+  uint32_t length = len;
+  aml_buffer_append(h->sample_bh, &length, sizeof(length));
+  aml_buffer_append(h->sample_bh, d, len);
+  h->num_sampled++;
+  size_t sample_size = h->ext_options.range_sample_size;
+  if (!sample_size)
+    sample_size = 1000 * h->num_partitions;
+  if (h->num_sampled < sample_size &&
+      aml_buffer_length(h->sample_bh) < h->options.buffer_size)
+    return true;
+  return finish_sample(h, true);
+}
+
+static void read_sample_file(io_out_partitioned_t *h) {
+  io_in_options_t opts;
+  io_in_options_init(&opts);
+  io_in_options_format(&opts, h->ext_options.range_sample_format);
+  io_in_t *in = io_in_init(h->ext_options.range_sample_file, &opts);
+  io_record_t *r;
+  while ((r = io_in_advance(in)) != NULL) {
+    aml_buffer_append(h->sample_bh, &(r->length), sizeof(r->length));
+    aml_buffer_append(h->sample_bh, r->record, r->length);
+    h->num_sampled++;
+  }
+  io_in_destroy(in);
+}
+
+static int _fixed_record_compare(const io_record_t *a, const io_record_t *b,
+                                 void *arg);
+
 io_out_t *io_out_partitioned_init(const char *filename,
                                   io_out_options_t *options,
                                   io_out_ext_options_t *ext_options) {
@@ -863,18 +1819,28 @@ io_out_t *io_out_partitioned_init(const char *filename,
     if (!filename)
       abort();
 
+    size_t max_dir_len;
+    size_t dirs_size = tmp_dirs_size(ext_options, &max_dir_len);
     io_out_partitioned_t *h = (io_out_partitioned_t *)aml_malloc(
-        sizeof(io_out_partitioned_t) + strlen(filename) + 1 +
+        sizeof(io_out_partitioned_t) + dirs_size + strlen(filename) + 1 +
         (sizeof(io_out_t *) * ext_options->num_partitions));
     memset(h, 0, sizeof(*h));
     h->options = *options;
     h->part_options = *options;
     h->ext_options = *ext_options;
-    h->ext_part_options = *ext_options;
     h->partitions = (io_out_t **)(h + 1);
     h->num_partitions = ext_options->num_partitions;
-    h->filename = (char *)(h->partitions + ext_options->num_partitions);
+    h->filename = copy_tmp_dirs(
+        &(h->ext_options), (char *)(h->partitions + h->num_partitions));
+    /* a fixed compare is adapted to records by _fixed_record_compare, which
+       needs the options (range partitioning and io_out_in compare here) */
+    if (h->ext_options.compare == _fixed_record_compare)
+      h->ext_options.compare_arg = &(h->ext_options);
+    if (h->ext_options.int_compare == _fixed_record_compare)
+      h->ext_options.int_compare_arg = &(h->ext_options);
+    h->ext_part_options = h->ext_options;
     strcpy(h->filename, filename);
+    h->tmp_name_len = strlen(filename) + max_dir_len + 41;
     h->partition = ext_options->partition;
     h->partition_arg = ext_options->partition_arg;
 
@@ -886,118 +1852,382 @@ io_out_t *io_out_partitioned_init(const char *filename,
       h->part_options.write_ack_file = false;
     }
 
-    size_t tmp_name_len = strlen(filename) + 40;
-    char *tmp_name = (char *)aml_malloc(tmp_name_len);
-    for (size_t i = 0; i < h->num_partitions; i++) {
-      // printf("%s\n", tmp_name);
-      if (h->ext_options.sort_while_partitioning || !h->ext_options.compare) {
-        suffix_filename_with_id(tmp_name, tmp_name_len, filename, i, NULL, false);
-        h->partitions[i] = io_out_ext_init(tmp_name, &(h->part_options),
-                                           &(h->ext_part_options));
-      } else {
-        suffix_filename_with_id(tmp_name, tmp_name_len, filename, i, "unsorted",
-                                h->ext_options.lz4_tmp);
-        h->partitions[i] = io_out_init(tmp_name, &(h->part_options));
+    char *tmp_name = (char *)aml_malloc(h->tmp_name_len);
+    h->bucketed = h->ext_options.bucketed_spill &&
+                  !h->ext_options.sort_while_partitioning;
+    if (h->bucketed) {
+      h->spill_bh = aml_buffer_init(h->options.buffer_size + 1);
+      h->order_bh = aml_buffer_init(1024);
+      h->blocks_bh = aml_buffer_init(1024);
+      h->counts = (size_t *)aml_malloc(sizeof(size_t) * h->num_partitions);
+      h->spill_fd = -1;
+      io_out_options_t spill_options;
+      io_out_options_init(&spill_options);
+      io_out_options_format(&spill_options, io_prefix());
+      io_out_options_buffer_size(&spill_options, 1024 * 1024);
+      spill_filename(h, tmp_name);
+      h->spill_out = io_out_init(tmp_name, &spill_options);
+      h->route_record = write_bucketed_record;
+    } else {
+      for (size_t i = 0; i < h->num_partitions; i++) {
+        // printf("%s\n", tmp_name);
+        if (h->ext_options.sort_while_partitioning ||
+            !h->ext_options.compare) {
+          suffix_filename_with_id(tmp_name, h->tmp_name_len, filename, i,
+                                  NULL, false);
+          h->partitions[i] = io_out_ext_init(tmp_name, &(h->part_options),
+                                             &(h->ext_part_options));
+        } else {
+          unsorted_filename(h, tmp_name, i);
+          h->partitions[i] = io_out_init(tmp_name, &(h->part_options));
+        }
       }
+      h->route_record = write_partitioned_record;
     }
-    h->write_record = write_partitioned_record;
+    h->write_record = h->route_record;
     aml_free(tmp_name);
     h->type = IO_OUT_PARTITIONED_TYPE;
+    if (h->partition == _range_partition) {
+      if (!h->ext_options.compare)
+        abort();
+      h->partition_arg = h;
+      h->sample_bh = aml_buffer_init(1024);
+      if (h->ext_options.range_sample_file) {
+        read_sample_file(h);
+        finish_sample(h, false);
+      } else
+        h->write_record = write_sampled_record;
+    }
     return (io_out_t *)h;
   }
 }
 
-void *sort_partitions(void *arg) {
-  io_out_partitioned_t *h = (io_out_partitioned_t *)arg;
-  char *filename = h->filename;
-  size_t tmp_name_len = strlen(filename) + 40;
-  char *tmp_name = (char *)aml_malloc(tmp_name_len);
+static size_t *next_partition(io_out_partitioned_t *h) {
+  pthread_mutex_lock(&h->mutex);
+  size_t *tp = h->taskp;
+  h->taskp++;
+  pthread_mutex_unlock(&h->mutex);
+  return tp < h->taskep ? tp : NULL;
+}
 
-  while (true) {
+/* the next partition to sort with a share of the memory and of the threads
+   which aren't busy (finish_sort_task gives them back) */
+static size_t *next_sort_task(io_out_partitioned_t *h,
+                              io_out_options_t *options,
+                              io_out_ext_options_t *ext_options) {
+  pthread_mutex_lock(&h->mutex);
+  size_t *tp = h->taskp;
+  if (tp >= h->taskep) {
+    pthread_mutex_unlock(&h->mutex);
+    return NULL;
+  }
+  h->taskp++;
+  size_t num_tasks = h->taskep - tp;
+  size_t free_threads = h->num_threads - h->busy_threads;
+  if (num_tasks > free_threads)
+    num_tasks = free_threads;
+  /* A record of len bytes is len + 4 bytes in the unsorted partition and
+     len + sizeof(io_record_t) + 5 bytes in the sort buffer, so every 4 bytes
+     of the partition need at most sizeof(io_record_t) + 5 bytes to be sorted
+     in memory.  Compressed partitions don't have a usable size (the spill
+     file is never compressed). */
+  size_t memory = (h->sort_memory - h->sort_memory_used) / num_tasks;
+  if (h->bucketed || !h->ext_options.lz4_tmp) {
+    size_t size = h->sizes[*tp];
+    size_t needed = size + (size / 4) * (sizeof(io_record_t) + 1) + 64;
+    if (memory > needed)
+      memory = needed;
+  }
+  h->sort_memory_used += memory;
+  h->busy_threads++;
+  pthread_mutex_unlock(&h->mutex);
+
+  *options = h->part_options;
+  options->buffer_size = memory;
+  *ext_options = h->ext_part_options;
+  return tp;
+}
+
+static void finish_sort_task(io_out_partitioned_t *h,
+                             io_out_options_t *options) {
+  pthread_mutex_lock(&h->mutex);
+  h->sort_memory_used -= options->buffer_size;
+  h->busy_threads--;
+  pthread_mutex_unlock(&h->mutex);
+}
+
+/* sort the unsorted partition id into an output named after the partition
+   (or just write it if there isn't a compare) */
+static io_out_t *sort_partition(io_out_partitioned_t *h, size_t id,
+                                char *tmp_name, io_out_options_t *options,
+                                io_out_ext_options_t *ext_options) {
+  io_in_t *in;
+  if (h->bucketed)
+    in = spill_in(h, id);
+  else {
+    /* io_in_init adjusts the options for lz4 */
+    io_in_options_t in_options = h->in_options;
+    unsorted_filename(h, tmp_name, id);
+    in = io_in_init(tmp_name, &in_options);
+  }
+  suffix_filename_with_id(tmp_name, h->tmp_name_len, h->filename, id, NULL,
+                          false);
+  io_out_t *out = io_out_ext_init(tmp_name, options, ext_options);
+  io_record_t *r;
+  while ((r = io_in_advance(in)) != NULL)
+    io_out_write_record(out, r->record, r->length);
+  io_in_destroy(in);
+  return out;
+}
+
+void *sort_partitions(void *arg) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)arg;
+  char *tmp_name = (char *)aml_malloc(h->tmp_name_len);
+  io_out_options_t options;
+  io_out_ext_options_t ext_options;
+  size_t *tp;
+  while ((tp = next_sort_task(h, &options, &ext_options)) != NULL) {
+    io_out_destroy(sort_partition(h, *tp, tmp_name, &options, &ext_options));
+    finish_sort_task(h, &options);
+  }
+  give_spare_threads(&(h->spare), 1);
+  aml_free(tmp_name);
+  return NULL;
+}
+
+/* the cursor of a partition, sorted partitions are written to tmp files
+   instead of being kept in memory once max_memory is used */
+static io_in_t *partition_in(io_out_partitioned_t *h, io_out_t *out) {
+  size_t size = sorted_in_memory(out);
+  if (size) {
     pthread_mutex_lock(&h->mutex);
-    size_t *tp = h->taskp;
-    h->taskp++;
+    bool spill = h->memory + size > h->max_memory;
+    if (!spill)
+      h->memory += size;
     pthread_mutex_unlock(&h->mutex);
-    if (tp >= h->taskep)
-      break;
+    if (spill)
+      sorted_spill(out);
+  }
+  return io_out_in(out);
+}
 
-    suffix_filename_with_id(tmp_name, tmp_name_len, filename, *tp, "unsorted",
-                            h->ext_options.lz4_tmp);
-    io_in_t *in = io_in_init(tmp_name, &(h->in_options));
-    suffix_filename_with_id(tmp_name, tmp_name_len, filename, *tp, NULL, false);
-    io_out_t *out =
-        io_out_ext_init(tmp_name, &(h->part_options), &(h->ext_part_options));
-    io_record_t *r;
-    while ((r = io_in_advance(in)) != NULL)
-      io_out_write_record(out, r->record, r->length);
-    io_out_destroy(out);
-    io_in_destroy(in);
+static void *partition_ins(void *arg) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)arg;
+  char *tmp_name = (char *)aml_malloc(h->tmp_name_len);
+  io_out_options_t options;
+  io_out_ext_options_t ext_options;
+  size_t *tp;
+  if (!h->sizes) {
+    /* the partitions are sorted already or there isn't a compare */
+    while ((tp = next_partition(h)) != NULL) {
+      if (h->bucketed)
+        h->ins[*tp] = spill_in(h, *tp);
+      else
+        h->ins[*tp] = partition_in(h, h->partitions[*tp]);
+    }
+  } else {
+    while ((tp = next_sort_task(h, &options, &ext_options)) != NULL) {
+      io_out_t *out = sort_partition(h, *tp, tmp_name, &options, &ext_options);
+      if (!h->bucketed) {
+        unsorted_filename(h, tmp_name, *tp);
+        remove(tmp_name);
+      }
+      h->ins[*tp] = partition_in(h, out);
+      finish_sort_task(h, &options);
+    }
+    give_spare_threads(&(h->spare), 1);
   }
   aml_free(tmp_name);
   return NULL;
 }
 
+typedef struct {
+  size_t size;
+  size_t id;
+} io_out_task_size_t;
+
+static int compare_task_size(const void *p1, const void *p2) {
+  const io_out_task_size_t *a = (const io_out_task_size_t *)p1;
+  const io_out_task_size_t *b = (const io_out_task_size_t *)p2;
+  if (a->size != b->size)
+    return a->size > b->size ? -1 : 1;
+  return a->id < b->id ? -1 : (a->id > b->id ? 1 : 0);
+}
+
+/* run thread_cb over the partitions on up to num_sort_threads threads.  If
+   the partitions are sorted (or written from the spill file), the largest
+   partitions are sorted first so that a large partition isn't sorted alone
+   at the end. */
+static void run_partition_threads(io_out_partitioned_t *h,
+                                  void *(*thread_cb)(void *), bool sort) {
+  /*  buffer_size memory, num_threads, input, output - prefer input
+     because OS will buffer output.
+    */
+  size_t num_threads = h->ext_options.num_sort_threads;
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > h->num_partitions)
+    num_threads = h->num_partitions;
+
+  size_t buffer_size = h->options.buffer_size / (num_threads * 2);
+
+  io_out_options_buffer_size(&(h->part_options), buffer_size);
+  io_out_options_format(&(h->part_options), h->options.format);
+  h->ext_part_options.use_extra_thread = false;
+  io_in_options_init(&(h->in_options));
+  io_in_options_buffer_size(&(h->in_options), buffer_size);
+  io_in_options_format(&(h->in_options), io_prefix());
+
+  h->tasks = (size_t *)aml_malloc(sizeof(size_t) * h->num_partitions);
+  h->taskp = h->tasks;
+  h->taskep = h->tasks + h->num_partitions;
+  for (size_t i = 0; i < h->num_partitions; i++)
+    h->tasks[i] = i;
+
+  h->num_threads = num_threads;
+  h->busy_threads = 0;
+  h->sort_memory = buffer_size * num_threads;
+  h->sort_memory_used = 0;
+  if (sort) {
+    h->sizes = (size_t *)aml_malloc(sizeof(size_t) * h->num_partitions);
+    io_out_task_size_t *sizes = (io_out_task_size_t *)aml_malloc(
+        sizeof(io_out_task_size_t) * h->num_partitions);
+    char *tmp_name = (char *)aml_malloc(h->tmp_name_len);
+    for (size_t i = 0; i < h->num_partitions; i++) {
+      h->sizes[i] = unsorted_size(h, i, tmp_name);
+      sizes[i].size = h->sizes[i];
+      sizes[i].id = i;
+    }
+    qsort(sizes, h->num_partitions, sizeof(*sizes), compare_task_size);
+    for (size_t i = 0; i < h->num_partitions; i++)
+      h->tasks[i] = sizes[i].id;
+    aml_free(tmp_name);
+    aml_free(sizes);
+  }
+
+  pthread_mutex_init(&h->mutex, NULL);
+  pthread_mutex_init(&h->spare.mutex, NULL);
+  h->spare.num_threads = 0;
+  if (sort)
+    h->ext_part_options.spare_threads = &(h->spare);
+  pthread_t *threads =
+      (pthread_t *)aml_malloc(sizeof(pthread_t) * num_threads);
+  for (size_t i = 0; i < num_threads; i++)
+    pthread_create(threads + i, NULL, thread_cb, h);
+  for (size_t i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+  h->ext_part_options.spare_threads = NULL;
+  pthread_mutex_destroy(&h->spare.mutex);
+  pthread_mutex_destroy(&h->mutex);
+  aml_free(h->tasks);
+  aml_free(threads);
+  if (h->sizes)
+    aml_free(h->sizes);
+  h->sizes = NULL;
+}
+
 void _io_out_partitioned_destroy(io_out_t *hp) {
   io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+  destroy_local_mutexes(h->local_mutexes, h->num_partitions + 1);
+  if (h->sample_bh)
+    finish_sample(h, true);
+  if (h->splitters)
+    aml_free(h->splitters);
+  if (h->bucketed) {
+    /* the final files are written from the spill file */
+    finish_spill(h);
+    run_partition_threads(h, sort_partitions, true);
+    remove_unsorted(h);
+    destroy_spill(h);
+    return;
+  }
   for (size_t i = 0; i < h->num_partitions; i++) {
     io_out_destroy(h->partitions[i]);
   }
   if (!h->ext_options.sort_while_partitioning && h->ext_options.compare) {
-    /*  buffer_size memory, num_threads, input, output - prefer input
-       because OS will buffer output.
-      */
-    size_t num_threads = h->ext_options.num_sort_threads;
-    if (num_threads < 1)
-      num_threads = 1;
-    if (num_threads > h->num_partitions)
-      num_threads = h->num_partitions;
-
-    size_t buffer_size = h->options.buffer_size / (num_threads * 2);
-
-    io_out_options_buffer_size(&(h->part_options), buffer_size);
-    io_out_options_format(&(h->part_options), h->options.format);
-    h->ext_part_options.use_extra_thread = false;
-    io_in_options_init(&(h->in_options));
-    io_in_options_buffer_size(&(h->in_options), buffer_size);
-    io_in_options_format(&(h->in_options), io_prefix());
-
-    h->tasks = (size_t *)aml_malloc(sizeof(size_t) * h->num_partitions);
-    h->taskp = h->tasks;
-    h->taskep = h->tasks + h->num_partitions;
-    for (size_t i = 0; i < h->num_partitions; i++)
-      h->tasks[i] = i;
-
-    pthread_mutex_init(&h->mutex, NULL);
-    pthread_t *threads =
-        (pthread_t *)aml_malloc(sizeof(pthread_t) * num_threads);
-    for (size_t i = 0; i < num_threads; i++)
-      pthread_create(threads + i, NULL, sort_partitions, h);
-    for (size_t i = 0; i < num_threads; i++)
-      pthread_join(threads[i], NULL);
-    pthread_mutex_destroy(&h->mutex);
-    aml_free(h->tasks);
-    aml_free(threads);
-    char *filename = h->filename;
-    size_t tmp_name_len = strlen(h->filename) + 40;
-    char *tmp_name = (char *)aml_malloc(tmp_name_len);
-    for (size_t i = 0; i < h->num_partitions; i++) {
-      suffix_filename_with_id(tmp_name, tmp_name_len, filename, i, "unsorted",
-                              h->ext_options.lz4_tmp);
-      remove(tmp_name);
-    }
-    aml_free(tmp_name);
+    run_partition_threads(h, sort_partitions, true);
+    remove_unsorted(h);
   }
 }
 
-io_in_t *io_out_partitioned_in(io_out_t *hp) {
-  _io_out_partitioned_destroy(hp);
-  /*  TODO:
-      1. either a list of files or a compared set with heap */
-  // for now return NULL as this would be unusual case
-  aml_free(hp);
+/* range partitions (and unsorted partitions) are read one after another */
+static io_in_t *next_partition_in(void *arg) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)arg;
+  while (h->cur_in < h->num_partitions) {
+    io_in_t *in = h->ins[h->cur_in];
+    h->ins[h->cur_in] = NULL;
+    h->cur_in++;
+    if (in)
+      return in;
+  }
   return NULL;
 }
 
+static void partitioned_in_destroy(io_out_t *hp) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+  for (size_t i = 0; i < h->num_partitions; i++)
+    io_in_destroy(h->ins[i]);
+  aml_free(h->ins);
+  if (h->bucketed) {
+    remove_unsorted(h);
+    destroy_spill(h);
+  }
+  aml_free(h);
+}
+
+io_in_t *io_out_partitioned_in(io_out_t *hp) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+  destroy_local_mutexes(h->local_mutexes, h->num_partitions + 1);
+  if (h->sample_bh)
+    finish_sample(h, true);
+  if (h->splitters)
+    aml_free(h->splitters);
+  h->splitters = NULL;
+
+  /* the partitions are read instead of writing the final files, sorting
+     uses half of the buffer and the sorted partitions kept in memory use
+     the rest */
+  io_out_ext_options_t *o = &(h->ext_options);
+  h->max_memory = h->options.buffer_size;
+  if (h->bucketed)
+    finish_spill(h);
+  if (o->compare && !o->sort_while_partitioning) {
+    for (size_t i = 0; i < h->num_partitions && !h->bucketed; i++)
+      io_out_destroy(h->partitions[i]);
+    h->max_memory /= 2;
+  }
+  h->ins = (io_in_t **)aml_zalloc(sizeof(io_in_t *) * h->num_partitions);
+  run_partition_threads(h, partition_ins,
+                        o->compare && !o->sort_while_partitioning);
+  /* the unsorted partitions are still read if there isn't a compare */
+  if (h->bucketed && o->compare)
+    remove_unsorted(h);
+
+  io_in_t *in = NULL;
+  if (o->compare && h->partition != _range_partition) {
+    /* keys are in one partition, so the merge doesn't need to reduce */
+    io_in_options_t opts;
+    io_in_options_init(&opts);
+    io_in_options_key_prefix(&opts, o->key_prefix, o->key_prefix_arg);
+    for (size_t i = 0; i < h->num_partitions; i++) {
+      if (!h->ins[i])
+        continue;
+      if (!in)
+        in = io_in_ext_init(o->compare, o->compare_arg, &opts);
+      io_in_ext_add(in, h->ins[i], i);
+      h->ins[i] = NULL;
+    }
+  } else
+    in = io_in_init_from_cb(next_partition_in, h);
+
+  if (!in) {
+    partitioned_in_destroy(hp);
+    return NULL;
+  }
+  io_in_destroy_out(in, hp, partitioned_in_destroy);
+  return in;
+}
+
 void io_out_partitioned_destroy(io_out_t *hp) {
   _io_out_partitioned_destroy(hp);
   aml_free(hp);
@@ -1009,6 +2239,8 @@ typedef struct {
   char *ep;
   size_t num_records;
   size_t size;
+  /* records were written in order and don't need to be sorted */
+  bool sorted;
 } io_out_buffer_t;
 
 const int EXTRA_IN = 0;
@@ -1022,6 +2254,11 @@ typedef struct extra_s {
   struct extra_s *next;
 } extra_t;
 
+typedef struct {
+  io_record_t r;
+  size_t run;
+} io_out_rs_record_t;
+
 typedef struct {
   int type;
   io_out_options_t options;
@@ -1033,6 +2270,7 @@ typedef struct {
   char *suffix;
 
   char *tmp_filename;
+  size_t tmp_name_len;
 
   io_out_buffer_t buf1, buf2;
   io_out_buffer_t *b, *b2;
@@ -1049,9 +2287,53 @@ typedef struct {
 
   io_out_ext_options_t ext_options;
   io_out_ext_options_t partition_options;
+
+  /* records are packed in the buffer when fixed length with a fixed_compare */
+  size_t fixed;
+
+  /* replacement selection keeps a heap of records (ordered by run and then
+     by int_compare) and streams the smallest to the current run */
+  bool replacement_selection;
+  io_out_rs_record_t *heap;
+  size_t num_heap;
+  size_t heap_size;
+  size_t heap_bytes;
+  size_t max_heap_bytes;
+  size_t run;
+  io_out_t *run_out;
+  io_out_rs_record_t last;
+
+  /* the last record of the previous tmp file, if each tmp file starts after
+     the previous one ends, the tmp files are read in order (not merged) */
+  bool runs_unordered;
+  char *last_run_record;
+  uint32_t last_run_length;
+  size_t last_run_size;
+
+  /* the combiner's open addressing table of (hash << 32) | (index + 1) for
+     the records in b */
+  uint64_t *table;
+  size_t table_size;
+  size_t table_used;
+  aml_buffer_t *combine_bh;
+
+  /* with a limit, once limit records are kept, records greater than the
+     last of them (limit_last) are skipped */
+  bool limit_full;
+  io_record_t limit_last;
+  aml_buffer_t *limit_bh;
+
+  /* guards writes from thread local writers */
+  pthread_mutex_t *local_mutexes;
 } io_out_sorted_t;
 
 bool write_sorted_record(io_out_t *hp, const void *d, size_t len);
+static bool write_fixed_sorted_record(io_out_t *hp, const void *d,
+                                      size_t len);
+static bool write_rs_record(io_out_t *hp, const void *d, size_t len);
+static bool write_combined_record(io_out_t *hp, const void *d, size_t len);
+static bool write_limited_record(io_out_t *hp, const void *d, size_t len);
+static void rs_finish(io_out_sorted_t *h);
 
 static void _extra_add(io_out_t *hp, void *p, int type) {
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
@@ -1082,20 +2364,31 @@ void io_out_sorted_add_ack_file(io_out_t *hp, const char *filename) {
   _extra_add(hp, (void *)filename, EXTRA_ACK_FILE);
 }
 
-static void tmp_filename(char *dest, const char *filename, uint32_t n,
+static void tmp_filename(char *dest, io_out_sorted_t *h, uint32_t n,
                          const char *suffix) {
-  snprintf(dest, strlen(filename) + 24 + strlen(suffix), "%s_%u_tmp%s", filename, n, suffix);
+  if (h->ext_options.num_tmp_dirs)
+    snprintf(dest, h->tmp_name_len, "%s/%s_%u_tmp%s",
+             tmp_dir(&(h->ext_options), h->filename, n),
+             base_filename(h->filename), n, suffix);
+  else
+    snprintf(dest, h->tmp_name_len, "%s_%u_tmp%s", h->filename, n, suffix);
 }
 
-static void group_tmp_filename(char *dest, const char *filename, uint32_t n,
+static void group_tmp_filename(char *dest, io_out_sorted_t *h, uint32_t n,
                                const char *suffix) {
-  snprintf(dest, strlen(filename) + strlen(suffix) + 30, "%s_%u_gtmp%s", filename, n, suffix);
+  if (h->ext_options.num_tmp_dirs)
+    snprintf(dest, h->tmp_name_len, "%s/%s_%u_gtmp%s",
+             tmp_dir(&(h->ext_options), h->filename, n),
+             base_filename(h->filename), n, suffix);
+  else
+    snprintf(dest, h->tmp_name_len, "%s_%u_gtmp%s", h->filename, n, suffix);
 }
 
 static inline void clear_buffer(io_out_buffer_t *b) {
   b->bp = b->buffer;
   b->ep = b->bp + b->size;
   b->num_records = 0;
+  b->sorted = true;
 }
 
 static inline void init_buffer(io_out_buffer_t *b, size_t buffer_size) {
@@ -1104,19 +2397,352 @@ static inline void init_buffer(io_out_buffer_t *b, size_t buffer_size) {
   clear_buffer(b);
 }
 
+static void _sort_buffer_records(io_out_sorted_t *h, io_record_t *r,
+                                 size_t num_r) {
+  if (h->ext_options.radix)
+    io_sort_records_radix(r, num_r, h->ext_options.radix);
+  else if (h->ext_options.key_prefix)
+    io_sort_records_by_prefix(r, num_r, h->ext_options.int_compare,
+                              h->ext_options.int_compare_arg,
+                              h->ext_options.key_prefix,
+                              h->ext_options.key_prefix_arg);
+  else
+    io_sort_records(r, num_r, h->ext_options.int_compare,
+                    h->ext_options.int_compare_arg);
+}
+
+/* buffers are only split across threads if each thread gets at least this
+   many records */
+static const size_t MIN_RECORDS_PER_SORT_THREAD = 16384;
+
+/* The records are split into num_threads runs which are sorted in parallel.
+   Splitters sampled from the sorted runs divide each run into num_threads
+   slices.  Task i merges slice i of every run into its own region of dest. */
+typedef struct {
+  io_out_sorted_t *h;
+  io_record_t *r;
+  size_t num_r;
+
+  io_record_t **starts;
+  io_record_t **ends;
+  size_t *heap;
+  size_t num_runs;
+  io_record_t *dest;
+} io_out_sort_task_t;
+
+static void *_sort_run_thread(void *arg) {
+  io_out_sort_task_t *t = (io_out_sort_task_t *)arg;
+  _sort_buffer_records(t->h, t->r, t->num_r);
+  return NULL;
+}
+
+static inline bool _sort_heap_less(io_out_sort_task_t *t, size_t a,
+                                   size_t b) {
+  int n = t->h->ext_options.int_compare(t->starts[a], t->starts[b],
+                                        t->h->ext_options.int_compare_arg);
+  if (n)
+    return n < 0;
+  return a < b;
+}
+
+static void _sort_heap_down(io_out_sort_task_t *t, size_t num_heap) {
+  size_t *heap = t->heap;
+  size_t i = 0;
+  while (true) {
+    size_t c = (i << 1) + 1;
+    if (c >= num_heap)
+      break;
+    if (c + 1 < num_heap && _sort_heap_less(t, heap[c + 1], heap[c]))
+      c++;
+    if (!_sort_heap_less(t, heap[c], heap[i]))
+      break;
+    size_t tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+static void *_merge_slices_thread(void *arg) {
+  io_out_sort_task_t *t = (io_out_sort_task_t *)arg;
+  size_t num_heap = 0;
+  for (size_t i = 0; i < t->num_runs; i++) {
+    if (t->starts[i] < t->ends[i])
+      t->heap[num_heap++] = i;
+  }
+  /* build the heap by inserting each run */
+  for (size_t i = 1; i < num_heap; i++) {
+    size_t j = i;
+    while (j) {
+      size_t p = (j - 1) >> 1;
+      if (!_sort_heap_less(t, t->heap[j], t->heap[p]))
+        break;
+      size_t tmp = t->heap[j];
+      t->heap[j] = t->heap[p];
+      t->heap[p] = tmp;
+      j = p;
+    }
+  }
+
+  io_record_t *wp = t->dest;
+  while (num_heap) {
+    size_t run = t->heap[0];
+    *wp++ = *t->starts[run]++;
+    if (t->starts[run] == t->ends[run])
+      t->heap[0] = t->heap[--num_heap];
+    _sort_heap_down(t, num_heap);
+  }
+  return NULL;
+}
+
+static io_record_t *_lower_bound_record(io_out_sorted_t *h, io_record_t *lo,
+                                        io_record_t *hi,
+                                        const io_record_t *key) {
+  while (lo < hi) {
+    io_record_t *mid = lo + ((hi - lo) >> 1);
+    if (h->ext_options.int_compare(mid, key, h->ext_options.int_compare_arg) <
+        0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void _parallel_sort_buffer_records(io_out_sorted_t *h, io_record_t *r,
+                                          size_t num_r, size_t num_threads) {
+  size_t nt = num_threads;
+  io_out_sort_task_t *tasks = (io_out_sort_task_t *)aml_malloc(
+      (sizeof(io_out_sort_task_t) + sizeof(pthread_t) +
+       (sizeof(io_record_t *) * 2 + sizeof(size_t)) * nt) * nt);
+  pthread_t *threads = (pthread_t *)(tasks + nt);
+  io_record_t **slices = (io_record_t **)(threads + nt);
+  size_t *heaps = (size_t *)(slices + (nt * nt * 2));
+
+  for (size_t i = 0; i < nt; i++) {
+    tasks[i].h = h;
+    tasks[i].r = r + (num_r * i) / nt;
+    tasks[i].num_r = (num_r * (i + 1)) / nt - (num_r * i) / nt;
+    pthread_create(threads + i, NULL, _sort_run_thread, tasks + i);
+  }
+  for (size_t i = 0; i < nt; i++)
+    pthread_join(threads[i], NULL);
+
+  /* sample evenly from each run and choose nt-1 splitters */
+  const size_t samples_per_run = 16;
+  size_t num_samples = nt * samples_per_run;
+  io_record_t *samples =
+      (io_record_t *)aml_malloc(sizeof(io_record_t) * num_samples);
+  for (size_t i = 0; i < nt; i++) {
+    for (size_t j = 0; j < samples_per_run; j++)
+      samples[i * samples_per_run + j] =
+          tasks[i].r[(tasks[i].num_r * j) / samples_per_run];
+  }
+  io_sort_records(samples, num_samples, h->ext_options.int_compare,
+                  h->ext_options.int_compare_arg);
+
+  /* slice j of run i is [slices[j*nt*2+i], slices[j*nt*2+nt+i]) */
+  for (size_t i = 0; i < nt; i++) {
+    io_record_t *rp = tasks[i].r;
+    io_record_t *ep = rp + tasks[i].num_r;
+    for (size_t j = 0; j < nt; j++) {
+      io_record_t **starts = slices + (j * nt * 2);
+      starts[i] = rp;
+      if (j + 1 < nt)
+        rp = _lower_bound_record(h, rp, ep,
+                                 samples + ((j + 1) * samples_per_run));
+      else
+        rp = ep;
+      starts[nt + i] = rp;
+    }
+  }
+  aml_free(samples);
+
+  io_record_t *dest = (io_record_t *)aml_malloc(sizeof(io_record_t) * num_r);
+  io_record_t *wp = dest;
+  for (size_t j = 0; j < nt; j++) {
+    io_out_sort_task_t *t = tasks + j;
+    t->starts = slices + (j * nt * 2);
+    t->ends = t->starts + nt;
+    t->heap = heaps + (j * nt);
+    t->num_runs = nt;
+    t->dest = wp;
+    for (size_t i = 0; i < nt; i++)
+      wp += t->ends[i] - t->starts[i];
+  }
+  for (size_t i = 0; i < nt; i++)
+    pthread_create(threads + i, NULL, _merge_slices_thread, tasks + i);
+  for (size_t i = 0; i < nt; i++)
+    pthread_join(threads[i], NULL);
+
+  memcpy(r, dest, sizeof(io_record_t) * num_r);
+  aml_free(dest);
+  aml_free(tasks);
+}
+
+static inline void _swap_fixed(char *a, char *b, size_t size) {
+  while (size >= sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    memcpy(a, &y, sizeof(y));
+    memcpy(b, &x, sizeof(x));
+    a += sizeof(x);
+    b += sizeof(x);
+    size -= sizeof(x);
+  }
+  while (size) {
+    char t = *a;
+    *a++ = *b;
+    *b++ = t;
+    size--;
+  }
+}
+
+/* quicksort packed records of size bytes using the fixed_compare */
+static void _sort_fixed(char *base, size_t n, size_t size,
+                        io_fixed_compare_cb cmp, void *arg) {
+  while (n > 16) {
+    char *mid = base + (n >> 1) * size;
+    char *hi = base + (n - 1) * size;
+    if (cmp(mid, base, arg) < 0)
+      _swap_fixed(mid, base, size);
+    if (cmp(hi, mid, arg) < 0) {
+      _swap_fixed(hi, mid, size);
+      if (cmp(mid, base, arg) < 0)
+        _swap_fixed(mid, base, size);
+    }
+    /* the pivot is moved to base, hi is a sentinel for i */
+    _swap_fixed(base, mid, size);
+    char *i = base;
+    char *j = base + n * size;
+    while (true) {
+      do
+        i += size;
+      while (cmp(i, base, arg) < 0);
+      do
+        j -= size;
+      while (cmp(j, base, arg) > 0);
+      if (i >= j)
+        break;
+      _swap_fixed(i, j, size);
+    }
+    _swap_fixed(base, j, size);
+
+    size_t left = (j - base) / size;
+    size_t right = n - left - 1;
+    if (left < right) {
+      _sort_fixed(base, left, size, cmp, arg);
+      base = j + size;
+      n = right;
+    } else {
+      _sort_fixed(j + size, right, size, cmp, arg);
+      n = left;
+    }
+  }
+  for (size_t k = 1; k < n; k++) {
+    char *p = base + k * size;
+    while (p > base && cmp(p - size, p, arg) > 0) {
+      _swap_fixed(p - size, p, size);
+      p -= size;
+    }
+  }
+}
+
+/* reduce runs of equal records in place and return the number kept */
+static size_t _reduce_fixed(io_out_sorted_t *h, char *base, size_t n) {
+  io_out_ext_options_t *o = &(h->ext_options);
+  size_t size = h->fixed;
+  char *wp = base;
+  char *p = base;
+  char *ep = base + n * size;
+  while (p < ep) {
+    char *q = p + size;
+    while (q < ep && !o->fixed_compare(p, q, o->fixed_compare_arg))
+      q += size;
+    if (o->fixed_reducer(p, (q - p) / size, o->fixed_reducer_arg)) {
+      if (wp != p)
+        memmove(wp, p, size);
+      wp += size;
+    }
+    p = q;
+  }
+  return (wp - base) / size;
+}
+
+static io_in_t *_in_from_fixed_buffer(io_out_sorted_t *h, io_out_buffer_t *b) {
+  char *p = b->buffer;
+  size_t num_r = b->num_records;
+  if (b->sorted)
+    ;
+  else if (h->ext_options.fixed_sort)
+    h->ext_options.fixed_sort(p, num_r);
+  else
+    _sort_fixed(p, num_r, h->fixed, h->ext_options.fixed_compare,
+                h->ext_options.fixed_compare_arg);
+  if (h->ext_options.fixed_reducer)
+    num_r = _reduce_fixed(h, p, num_r);
+
+  clear_buffer(b);
+  return io_in_init_with_buffer(p, num_r * h->fixed, false,
+                                &(h->file_options));
+}
+
 static io_in_t *_in_from_buffer(io_out_sorted_t *h, io_out_buffer_t *b) {
   if (!b->num_records)
     return NULL;
 
+  if (h->fixed)
+    return _in_from_fixed_buffer(h, b);
+
   io_record_t *r = (io_record_t *)b->buffer;
   uint32_t num_r = b->num_records;
-  io_sort_records(r, num_r, h->ext_options.int_compare,
-                     h->ext_options.int_compare_arg);
+  size_t max_threads = num_r / MIN_RECORDS_PER_SORT_THREAD;
+  size_t num_threads = h->ext_options.sort_threads ? h->ext_options.sort_threads
+                                                   : 1;
+  if (num_threads > max_threads)
+    num_threads = max_threads;
+  size_t lent = 0;
+  if (!b->sorted && num_threads < max_threads) {
+    lent = take_spare_threads(h->ext_options.spare_threads,
+                              max_threads - num_threads);
+    num_threads += lent;
+  }
+  if (b->sorted)
+    ;
+  else if (num_threads > 1)
+    _parallel_sort_buffer_records(h, r, num_r, num_threads);
+  else
+    _sort_buffer_records(h, r, num_r);
+  give_spare_threads(h->ext_options.spare_threads, lent);
 
   clear_buffer(b);
   return io_in_records_init(r, num_r, &(h->file_options));
 }
 
+/* compare and reduce fixed length records stored in io_record_t structures
+   (used when merging tmp files).  arg points to the io_out_ext_options_t. */
+static int _fixed_record_compare(const io_record_t *a, const io_record_t *b,
+                                 void *arg) {
+  io_out_ext_options_t *o = (io_out_ext_options_t *)arg;
+  return o->fixed_compare(a->record, b->record, o->fixed_compare_arg);
+}
+
+static bool _fixed_record_reducer(io_record_t *res, const io_record_t *r,
+                                  size_t num_r, aml_buffer_t *bh, void *arg) {
+  io_out_ext_options_t *o = (io_out_ext_options_t *)arg;
+  aml_buffer_clear(bh);
+  for (size_t i = 0; i < num_r; i++)
+    aml_buffer_append(bh, r[i].record, r[i].length);
+  char *d = aml_buffer_data(bh);
+  if (!o->fixed_reducer(d, num_r, o->fixed_reducer_arg))
+    return false;
+  res->record = d;
+  res->length = r->length;
+  res->tag = r->tag;
+  return true;
+}
+
 io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
                              io_out_ext_options_t *ext_options) {
   io_out_options_t opts;
@@ -1125,9 +2751,12 @@ io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
     io_out_options_init(options);
   }
   size_t buffer_size = options->buffer_size;
+  size_t max_dir_len;
+  size_t dirs_size = tmp_dirs_size(ext_options, &max_dir_len);
   io_out_sorted_t *h = (io_out_sorted_t *)aml_zalloc(
-      sizeof(io_out_sorted_t) + (strlen(filename) * 3) + 100);
-  h->filename = (char *)(h + 1);
+      sizeof(io_out_sorted_t) + dirs_size + (strlen(filename) * 3) +
+      max_dir_len + 100);
+  h->filename = (char *)(h + 1) + dirs_size;
   strcpy(h->filename, filename);
   h->type = IO_OUT_SORTED_TYPE;
 
@@ -1145,17 +2774,45 @@ io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
   h->thread_started = false;
 
   h->ext_options = *ext_options;
-  h->partition_options = *ext_options;
+  copy_tmp_dirs(&(h->ext_options), (char *)(h + 1));
+  h->tmp_name_len = strlen(filename) + max_dir_len + 33;
+  h->partition_options = h->ext_options;
   h->partition_options.compare = NULL;
+  h->partition_options.fixed_compare = NULL;
   h->options = *options;
 
   io_in_options_init(&(h->file_options));
-  if (ext_options->int_reducer)
+  if (ext_options->fixed_compare && options->format > 0) {
+    /* records are sorted and reduced in the buffer, the record adapters are
+       only used to merge tmp files */
+    h->fixed = options->format;
+    io_out_ext_options_t *o = &(h->ext_options);
+    if (o->compare == _fixed_record_compare)
+      o->compare_arg = o;
+    if (o->int_compare == _fixed_record_compare)
+      o->int_compare_arg = o;
+    if (o->fixed_reducer) {
+      o->reducer = o->int_reducer = _fixed_record_reducer;
+      o->reducer_arg = o->int_reducer_arg = o;
+    }
+    io_in_options_format(&(h->file_options), io_fixed(h->fixed));
+  } else if (ext_options->int_reducer)
     io_in_options_reducer(&(h->file_options), ext_options->int_compare,
                           ext_options->int_compare_arg,
                           ext_options->int_reducer,
                           ext_options->int_reducer_arg);
 
+  if (ext_options->replacement_selection && !h->fixed) {
+    /* the buffer is only allocated if all of the records fit in memory */
+    h->replacement_selection = true;
+    h->max_heap_bytes = buffer_size;
+    h->buf1.size = buffer_size;
+    h->b = &(h->buf1);
+    h->b2 = &(h->buf1);
+    h->write_record = write_rs_record;
+    return (io_out_t *)h;
+  }
+
   if (ext_options->use_extra_thread) {
     buffer_size /= 2;
     init_buffer(&h->buf1, buffer_size);
@@ -1167,7 +2824,16 @@ io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
     h->b = &(h->buf1);
     h->b2 = &(h->buf1);
   }
-  h->write_record = write_sorted_record;
+  if (h->fixed)
+    h->write_record = write_fixed_sorted_record;
+  else if (ext_options->limit) {
+    h->limit_bh = aml_buffer_init(256);
+    h->write_record = write_limited_record;
+  } else if (ext_options->combiner && ext_options->int_reducer) {
+    h->combine_bh = aml_buffer_init(256);
+    h->write_record = write_combined_record;
+  } else
+    h->write_record = write_sorted_record;
   return (io_out_t *)h;
 }
 
@@ -1178,24 +2844,33 @@ static inline void wait_on_thread(io_out_sorted_t *h) {
   }
 }
 
+/* tmp files are written in the fixed format when records are fixed */
+static inline io_format_t tmp_format(io_out_sorted_t *h) {
+  return h->fixed ? io_fixed(h->fixed) : io_prefix();
+}
+
+static io_out_t *init_tmp_out(io_out_sorted_t *h, const char *filename) {
+  // allow output buffer to be supplied to io_out_options...
+  // allow input buffer to be supplied as well
+  io_out_options_t options;
+  io_out_options_init(&options);
+  io_out_options_format(&options, tmp_format(h));
+  /* reuse the same buffer? */
+  io_out_options_buffer_size(&options, 10 * 1024 * 1024);
+  return io_out_init(filename, &options);
+}
+
 io_out_t *get_next_tmp(io_out_sorted_t *h, bool tmp_only) {
   const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
   if (!tmp_only && h->ext_options.num_per_group) {
-    group_tmp_filename(h->tmp_filename, h->filename, h->num_group_written,
+    group_tmp_filename(h->tmp_filename, h, h->num_group_written,
                        suffix);
     h->num_group_written++;
   } else {
-    tmp_filename(h->tmp_filename, h->filename, h->num_written, suffix);
+    tmp_filename(h->tmp_filename, h, h->num_written, suffix);
     h->num_written++;
   }
-  // allow output buffer to be supplied to io_out_options...
-  // allow input buffer to be supplied as well
-  io_out_options_t options;
-  io_out_options_init(&options);
-  io_out_options_format(&options, io_prefix());
-  /* reuse the same buffer? */
-  io_out_options_buffer_size(&options, 10 * 1024 * 1024);
-  return io_out_init(h->tmp_filename, &options);
+  return init_tmp_out(h, h->tmp_filename);
 }
 
 void check_for_merge(io_out_sorted_t *h) {
@@ -1207,7 +2882,9 @@ void check_for_merge(io_out_sorted_t *h) {
 
   io_in_options_t opts;
   io_in_options_init(&opts);
-  io_in_options_format(&opts, io_prefix());
+  io_in_options_format(&opts, tmp_format(h));
+  io_in_options_key_prefix(&opts, h->ext_options.key_prefix,
+                           h->ext_options.key_prefix_arg);
   io_in_t *in =
       io_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
   if (h->ext_options.reducer)
@@ -1215,7 +2892,7 @@ void check_for_merge(io_out_sorted_t *h) {
 
   const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
   for (size_t i = 0; i < h->num_group_written; i++) {
-    group_tmp_filename(h->tmp_filename, h->filename, i, suffix);
+    group_tmp_filename(h->tmp_filename, h, i, suffix);
     io_in_ext_add(in, io_in_init(h->tmp_filename, &opts), 0);
   }
   io_record_t *r;
@@ -1227,9 +2904,49 @@ void check_for_merge(io_out_sorted_t *h) {
   h->num_group_written = 0;
 }
 
+/* Track whether this tmp file starts after the previous one ended.  The
+   records are the sorted buffer before any reduction which can only remove
+   records from the ends, and equal records must be merged if there is a
+   reducer. */
+static void check_run_order(io_out_sorted_t *h, char *buffer, size_t num_r) {
+  if (h->runs_unordered)
+    return;
+  io_record_t first, last;
+  if (h->fixed) {
+    first.record = buffer;
+    last.record = buffer + (num_r - 1) * h->fixed;
+    first.length = last.length = h->fixed;
+  } else {
+    io_record_t *r = (io_record_t *)buffer;
+    first = r[0];
+    last = r[num_r - 1];
+  }
+  if (h->last_run_record) {
+    io_record_t prev = {h->last_run_record, h->last_run_length, 0};
+    int n = h->ext_options.compare(&prev, &first, h->ext_options.compare_arg);
+    if (n > 0 || (n == 0 && h->ext_options.reducer)) {
+      h->runs_unordered = true;
+      return;
+    }
+  }
+  if (last.length + 1 > h->last_run_size) {
+    h->last_run_size = last.length + 1;
+    if (h->last_run_record)
+      aml_free(h->last_run_record);
+    h->last_run_record = (char *)aml_malloc(h->last_run_size);
+  }
+  memcpy(h->last_run_record, last.record, last.length);
+  h->last_run_record[last.length] = 0;
+  h->last_run_length = last.length;
+}
+
 void *write_sorted_thread(void *arg) {
   io_out_sorted_t *h = (io_out_sorted_t *)arg;
+  char *buffer = h->b2->buffer;
+  size_t num_r = h->b2->num_records;
   io_in_t *in = _in_from_buffer(h, h->b2);
+  if (num_r)
+    check_run_order(h, buffer, num_r);
   io_out_t *out = get_next_tmp(h, false);
   io_record_t *r;
   while ((r = io_in_advance(in)) != NULL)
@@ -1265,16 +2982,198 @@ void io_out_tag(io_out_t *hp, int tag) {
   h->tag = tag;
 }
 
-io_in_t *_io_out_sorted_in(io_out_t *hp) {
+/* Each input of a merge gets at least MIN_MERGE_BUFFER_SIZE of the buffer
+   for sequential reads, unless that limits the fan in below
+   MIN_MERGE_FAN_IN.  Read buffers are never smaller than
+   MIN_MERGE_INPUT_SIZE. */
+static const size_t MIN_MERGE_BUFFER_SIZE = 1024 * 1024;
+static const size_t MIN_MERGE_FAN_IN = 64;
+static const size_t MIN_MERGE_INPUT_SIZE = 16 * 1024;
+
+static size_t merge_threads(io_out_sorted_t *h) {
+  return h->ext_options.merge_threads ? h->ext_options.merge_threads : 1;
+}
+
+/* the descriptors merges may use, half are left for the rest of the
+   process */
+static size_t open_file_budget(void) {
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY)
+    return rl.rlim_cur / 2;
+  return SIZE_MAX;
+}
+
+/* the number of tmp files which may be merged at once, limited by the
+   memory budget, the open file limit (shared by merge threads) and
+   max_fan_in */
+static size_t merge_fan_in(io_out_sorted_t *h) {
+  size_t fan_in = h->buf1.size / MIN_MERGE_BUFFER_SIZE;
+  if (fan_in < MIN_MERGE_FAN_IN)
+    fan_in = MIN_MERGE_FAN_IN;
+
+  size_t fd_limit = open_file_budget() / merge_threads(h);
+  if (fan_in > fd_limit)
+    fan_in = fd_limit;
+  if (h->ext_options.max_fan_in && fan_in > h->ext_options.max_fan_in)
+    fan_in = h->ext_options.max_fan_in;
+  return fan_in < 2 ? 2 : fan_in;
+}
+
+static size_t merge_input_size(io_out_sorted_t *h, size_t num_inputs,
+                               size_t num_threads) {
+  size_t size = h->buf1.size / (num_threads * num_inputs);
+  return size < MIN_MERGE_INPUT_SIZE ? MIN_MERGE_INPUT_SIZE : size;
+}
+
+typedef struct {
+  io_out_sorted_t *h;
+  size_t *runs;
+  size_t num_runs;
+  size_t dest;
+  size_t buffer_size;
+} io_out_merge_task_t;
+
+/* merge runs into the tmp file dest and remove the runs */
+static void *merge_runs_thread(void *arg) {
+  io_out_merge_task_t *t = (io_out_merge_task_t *)arg;
+  io_out_sorted_t *h = t->h;
+  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  char *name = (char *)aml_malloc(h->tmp_name_len);
+
+  io_in_options_t opts;
+  io_in_options_init(&opts);
+  io_in_options_buffer_size(&opts, t->buffer_size);
+  io_in_options_format(&opts, tmp_format(h));
+  io_in_options_key_prefix(&opts, h->ext_options.key_prefix,
+                           h->ext_options.key_prefix_arg);
+  io_in_t *in =
+      io_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
+  if (h->ext_options.reducer)
+    io_in_ext_reducer(in, h->ext_options.reducer, h->ext_options.reducer_arg);
+  for (size_t i = 0; i < t->num_runs; i++) {
+    tmp_filename(name, h, t->runs[i], suffix);
+    io_in_ext_add(in, io_in_init(name, &opts), i);
+  }
+
+  tmp_filename(name, h, t->dest, suffix);
+  io_out_t *out = init_tmp_out(h, name);
+  io_record_t *r;
+  while ((r = io_in_advance(in)) != NULL)
+    io_out_write_record(out, r->record, r->length);
+  io_out_destroy(out);
+  io_in_destroy(in);
+
+  for (size_t i = 0; i < t->num_runs; i++) {
+    tmp_filename(name, h, t->runs[i], suffix);
+    remove(name);
+  }
+  aml_free(name);
+  return NULL;
+}
+
+/* Merge runs in passes until at most fan_in runs remain.  Each pass merges
+   no more runs than needed (full fan_in merges first) and the merges
+   within a pass run on up to merge_threads threads.  runs is updated to the
+   remaining runs and their count is returned. */
+static size_t cascade_merge(io_out_sorted_t *h, size_t *runs,
+                            size_t num_runs, size_t fan_in) {
+  size_t num_threads = merge_threads(h);
+  io_out_merge_task_t *tasks = (io_out_merge_task_t *)aml_malloc(
+      sizeof(io_out_merge_task_t) * num_runs);
+  pthread_t *threads = (pthread_t *)aml_malloc(sizeof(pthread_t) * num_runs);
+  while (num_runs > fan_in) {
+    size_t excess = num_runs - fan_in;
+    size_t num_tasks = 0;
+    size_t pos = 0;
+    while (excess && pos + 1 < num_runs) {
+      size_t n = excess + 1 < fan_in ? excess + 1 : fan_in;
+      if (n > num_runs - pos)
+        n = num_runs - pos;
+      io_out_merge_task_t *t = tasks + num_tasks;
+      t->h = h;
+      t->runs = runs + pos;
+      t->num_runs = n;
+      t->dest = h->num_written++;
+      pos += n;
+      excess -= n - 1;
+      num_tasks++;
+    }
+    /* spare threads (from partitions which are finished) may merge too, as
+       long as the open files stay within the budget */
+    size_t pass_threads = num_threads;
+    size_t max_threads = open_file_budget() / (fan_in + 1);
+    if (max_threads > num_tasks)
+      max_threads = num_tasks;
+    size_t lent = 0;
+    if (pass_threads < max_threads) {
+      lent = take_spare_threads(h->ext_options.spare_threads,
+                                max_threads - pass_threads);
+      pass_threads += lent;
+    }
+    size_t active = num_tasks < pass_threads ? num_tasks : pass_threads;
+    for (size_t i = 0; i < num_tasks; i++)
+      tasks[i].buffer_size = merge_input_size(h, tasks[i].num_runs + 1, active);
+
+    for (size_t i = 0; i < num_tasks; i += pass_threads) {
+      size_t n = num_tasks - i < pass_threads ? num_tasks - i : pass_threads;
+      for (size_t j = 1; j < n; j++)
+        pthread_create(threads + j, NULL, merge_runs_thread, tasks + i + j);
+      merge_runs_thread(tasks + i);
+      for (size_t j = 1; j < n; j++)
+        pthread_join(threads[j], NULL);
+    }
+    give_spare_threads(h->ext_options.spare_threads, lent);
+
+    /* the merged runs are replaced with the new runs */
+    size_t *wp = runs;
+    for (size_t i = 0; i < num_tasks; i++)
+      *wp++ = tasks[i].dest;
+    memmove(wp, runs + pos, (num_runs - pos) * sizeof(size_t));
+    num_runs = num_tasks + (num_runs - pos);
+  }
+  aml_free(threads);
+  aml_free(tasks);
+  return num_runs;
+}
+
+/* the tmp files are already in order, so read them one after another */
+static io_in_t *_sorted_runs_in(io_out_sorted_t *h, io_in_options_t *opts,
+                                const char *suffix) {
+  size_t name_len = h->tmp_name_len;
+  io_file_info_t *files = (io_file_info_t *)aml_zalloc(
+      (sizeof(io_file_info_t) + name_len) * h->num_written);
+  char *name = (char *)(files + h->num_written);
+  for (size_t i = 0; i < h->num_written; i++) {
+    tmp_filename(name, h, i, suffix);
+    files[i].filename = name;
+    files[i].size = io_file_size(name);
+    files[i].tag = i;
+    name += name_len;
+  }
+  io_in_t *in = io_in_init_from_list(files, h->num_written, opts);
+  aml_free(files);
+  if (!h->ext_options.reducer)
+    return in;
+
+  /* a single input still needs to be reduced */
+  io_in_t *ext =
+      io_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, opts);
+  io_in_ext_reducer(ext, h->ext_options.reducer, h->ext_options.reducer_arg);
+  io_in_ext_add(ext, in, 0);
+  return ext;
+}
+
+static io_in_t *_sorted_in(io_out_t *hp) {
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
-  if (h->type != IO_OUT_SORTED_TYPE)
-    return NULL;
 
   if (h->out_in_called)
     return NULL;
 
   h->out_in_called = true;
 
+  if (h->replacement_selection)
+    rs_finish(h);
+
   if (!h->num_written && !h->num_group_written) {
     if (&(h->buf1) == h->b) {
       if (h->buf2.buffer) {
@@ -1315,18 +3214,66 @@ io_in_t *_io_out_sorted_in(io_out_t *hp) {
   io_in_options_t opts;
   io_in_options_init(&opts);
   io_in_options_buffer_size(&opts, h->buf1.size / 10);
-  io_in_options_format(&opts, io_prefix());
+  io_in_options_format(&opts, tmp_format(h));
+  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  if (!h->runs_unordered && !h->ext_options.num_per_group)
+    return _sorted_runs_in(h, &opts, suffix);
+
+  size_t num_runs = h->num_written;
+  size_t *runs = (size_t *)aml_malloc(sizeof(size_t) * num_runs);
+  for (size_t i = 0; i < num_runs; i++)
+    runs[i] = i;
+  size_t fan_in = merge_fan_in(h);
+  if (num_runs > fan_in)
+    num_runs = cascade_merge(h, runs, num_runs, fan_in);
+
+  io_in_options_buffer_size(&opts, merge_input_size(h, num_runs, 1));
+  io_in_options_key_prefix(&opts, h->ext_options.key_prefix,
+                           h->ext_options.key_prefix_arg);
   io_in_t *in =
       io_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
   if (h->ext_options.reducer)
     io_in_ext_reducer(in, h->ext_options.reducer, h->ext_options.reducer_arg);
 
-  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
   // printf("%s num_written: %lu\n", h->filename, h->num_written);
-  for (size_t i = 0; i < h->num_written; i++) {
-    tmp_filename(h->tmp_filename, h->filename, i, suffix);
+  for (size_t i = 0; i < num_runs; i++) {
+    tmp_filename(h->tmp_filename, h, runs[i], suffix);
     io_in_ext_add(in, io_in_init(h->tmp_filename, &opts), i);
   }
+  aml_free(runs);
+  return in;
+}
+
+/* io_out_in keeps the buffer in memory if no tmp files were written */
+static size_t sorted_in_memory(io_out_t *hp) {
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
+  if (h->type != IO_OUT_SORTED_TYPE || h->out_in_called)
+    return 0;
+  if (h->replacement_selection)
+    rs_finish(h);
+  if (h->num_written || h->num_group_written || !h->b->num_records)
+    return 0;
+  return h->b->size;
+}
+
+/* write the buffer to a tmp file so that io_out_in doesn't keep it */
+static void sorted_spill(io_out_t *hp) {
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
+  /* there is only one tmp file, so it doesn't need to be grouped */
+  h->ext_options.num_per_group = 0;
+  write_sorted(h);
+  wait_on_thread(h);
+}
+
+io_in_t *_io_out_sorted_in(io_out_t *hp) {
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
+  if (h->type != IO_OUT_SORTED_TYPE)
+    return NULL;
+
+  io_in_t *in = _sorted_in(hp);
+  /* tmp files and the last buffer may have more than limit records */
+  if (in && h->ext_options.limit)
+    io_in_limit(in, h->ext_options.limit);
   return in;
 }
 
@@ -1345,11 +3292,21 @@ io_in_t *io_out_in(io_out_t *hp) {
   return in;
 }
 
-/*
-TODO: Add support for fixed length records.  These records don't need the
-io_record_t record array and can simply be sorted in place.
+bool write_one_record(io_out_sorted_t *h, const void *d, size_t len) {
+   wait_on_thread(h);
+   h->runs_unordered = true;
+   io_out_t *out = get_next_tmp(h, false);
+   io_out_write_record(out, d, len);
+   io_out_destroy(out);
+   if (h->ext_options.num_per_group)
+     check_for_merge(h);
+   return true;
+}
 
-bool write_fixed_sorted_record(io_out_t *hp, const void *d, size_t len) {
+/* Fixed length records don't need the io_record_t array and are packed in
+   the buffer so that they can be sorted in place. */
+static bool write_fixed_sorted_record(io_out_t *hp, const void *d,
+                                      size_t len) {
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
   if (len != h->fixed)
     abort();
@@ -1358,24 +3315,52 @@ bool write_fixed_sorted_record(io_out_t *hp, const void *d, size_t len) {
   if (bp + len > h->b->ep) {
     write_sorted(h);
     bp = h->b->bp;
+    if (bp + len > h->b->ep)
+      return write_one_record(h, d, len);
   }
 
   memcpy(bp, d, len);
+  if (h->b->sorted && h->b->num_records &&
+      h->ext_options.fixed_compare(bp - len, bp,
+                                   h->ext_options.fixed_compare_arg) > 0)
+    h->b->sorted = false;
   bp += len;
   h->b->bp = bp;
   h->b->num_records++;
   return true;
 }
+
+/* Write data to the end of the buffer and the records to the beginning.
+   This has the effect of keeping the records in the original order and
+   makes effective use of the buffer from both ends.  Later, the records
+   will be sorted.  The data is written with a zero terminator to make it
+   easy for string comparison functions.  The record is only added to the
+   buffer by add_staged_record (so that it can be compared first).
 */
+static inline void stage_record(io_out_sorted_t *h, io_record_t *r,
+                                const void *d, size_t len) {
+  char *ep = h->b->ep;
+  ep--;
+  *ep = 0;
+  ep -= len;
+  memcpy(ep, d, len);
 
-bool write_one_record(io_out_sorted_t *h, const void *d, size_t len) {
-   wait_on_thread(h);
-   io_out_t *out = get_next_tmp(h, false);
-   io_out_write_record(out, d, len);
-   io_out_destroy(out);
-   if (h->ext_options.num_per_group)
-     check_for_merge(h);
-   return true;
+  r->record = ep;
+  r->length = len;
+  r->tag = h->tag;
+}
+
+static inline void add_staged_record(io_out_sorted_t *h,
+                                     const io_record_t *r) {
+  io_record_t *nr = (io_record_t *)h->b->bp;
+  *nr = *r;
+  if (h->b->sorted && h->b->num_records &&
+      h->ext_options.int_compare(nr - 1, nr, h->ext_options.int_compare_arg) > 0)
+    h->b->sorted = false;
+
+  h->b->bp += sizeof(*nr);
+  h->b->ep = r->record;
+  h->b->num_records++;
 }
 
 bool write_sorted_record(io_out_t *hp, const void *d, size_t len) {
@@ -1384,45 +3369,387 @@ bool write_sorted_record(io_out_t *hp, const void *d, size_t len) {
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
 
   size_t length = len + sizeof(io_record_t) + 5;
-  char *bp = h->b->bp;
-  if (bp + length > h->b->ep) {
+  if (h->b->bp + length > h->b->ep) {
     write_sorted(h);
-    bp = h->b->bp;
-    if (bp + length > h->b->ep)
+    if (h->b->bp + length > h->b->ep)
       return write_one_record(h, d, len);
   }
 
-  /* Write data to the end of the buffer and the records to the beginning.
-     This has the effect of keeping the records in the original order and
-     makes effective use of the buffer from both ends.  Later, the records
-     will be sorted.  The data is written with a zero terminator to make it
-     easy for string comparison functions.
-  */
-  char *ep = h->b->ep;
-  ep--;
-  *ep = 0;
-  ep -= len;
-  memcpy(ep, d, len);
+  io_record_t r;
+  stage_record(h, &r, d, len);
+  add_staged_record(h, &r);
+  return true;
+}
 
-  io_record_t *r = (io_record_t *)bp;
-  r->record = ep;
-  r->length = len;
-  r->tag = h->tag;
-  bp += sizeof(*r);
+static inline uint32_t combine_hash(io_out_sorted_t *h, const io_record_t *r) {
+  uint64_t hash =
+      h->ext_options.combiner_hash(r, h->ext_options.combiner_hash_arg);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
 
-  h->b->bp = bp;
-  h->b->ep = ep;
-  h->b->num_records++;
+static void combine_reset(io_out_sorted_t *h) {
+  if (h->table)
+    memset(h->table, 0, sizeof(uint64_t) * h->table_size);
+  h->table_used = 0;
+}
+
+static void combine_grow(io_out_sorted_t *h) {
+  size_t size = h->table_size ? h->table_size * 2 : 1024;
+  uint64_t *table = (uint64_t *)aml_zalloc(sizeof(uint64_t) * size);
+  size_t mask = size - 1;
+  for (size_t i = 0; i < h->table_size; i++) {
+    if (!h->table[i])
+      continue;
+    size_t j = (h->table[i] >> 32) & mask;
+    while (table[j])
+      j = (j + 1) & mask;
+    table[j] = h->table[i];
+  }
+  if (h->table)
+    aml_free(h->table);
+  h->table = table;
+  h->table_size = size;
+}
+
+/* returns the slot of the record equal to r or the empty slot where it
+   belongs */
+static uint64_t *combine_find(io_out_sorted_t *h, uint32_t hash,
+                              const io_record_t *r) {
+  io_record_t *records = (io_record_t *)h->b->buffer;
+  size_t mask = h->table_size - 1;
+  size_t i = hash & mask;
+  while (h->table[i]) {
+    if ((h->table[i] >> 32) == hash &&
+        !h->ext_options.int_compare(records + (uint32_t)h->table[i] - 1, r,
+                                    h->ext_options.int_compare_arg))
+      break;
+    i = (i + 1) & mask;
+  }
+  return h->table + i;
+}
+
+/* removes the record in slot (its data is left in the buffer).  The last
+   record is moved into its place in the buffer and the slots after it are
+   shifted back so that lookups don't need tombstones. */
+static void combine_remove(io_out_sorted_t *h, uint64_t *slot) {
+  io_record_t *records = (io_record_t *)h->b->buffer;
+  uint32_t idx = (uint32_t)*slot - 1;
+  size_t mask = h->table_size - 1;
+  size_t i = slot - h->table;
+  size_t j = i;
+  while (true) {
+    j = (j + 1) & mask;
+    if (!h->table[j])
+      break;
+    size_t k = (h->table[j] >> 32) & mask;
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    h->table[i] = h->table[j];
+    i = j;
+  }
+  h->table[i] = 0;
+  h->table_used--;
+
+  uint32_t last = h->b->num_records - 1;
+  if (idx != last) {
+    records[idx] = records[last];
+    uint32_t hash = combine_hash(h, records + idx);
+    i = hash & mask;
+    while ((uint32_t)h->table[i] != last + 1)
+      i = (i + 1) & mask;
+    h->table[i] = ((uint64_t)hash << 32) | (idx + 1);
+    h->b->sorted = false;
+  }
+  h->b->num_records--;
+  h->b->bp -= sizeof(io_record_t);
+}
+
+/* The record is copied to the buffer as write_sorted_record does, but it
+   is only kept if there isn't an equal record in the table.  Otherwise the
+   two are reduced and the result replaces the record in the buffer. */
+static bool write_combined_record(io_out_t *hp, const void *d, size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
+
+  size_t length = len + sizeof(io_record_t) + 5;
+  if (h->b->bp + length > h->b->ep) {
+    write_sorted(h);
+    combine_reset(h);
+    if (h->b->bp + length > h->b->ep)
+      return write_one_record(h, d, len);
+  }
+  if ((h->table_used + 1) * 2 > h->table_size)
+    combine_grow(h);
+
+  io_record_t rec[2];
+  io_record_t *r = rec + 1;
+  stage_record(h, r, d, len);
+  uint32_t hash = combine_hash(h, r);
+  uint64_t *slot = combine_find(h, hash, r);
+  io_record_t *records = (io_record_t *)h->b->buffer;
+  if (!*slot) {
+    add_staged_record(h, r);
+    *slot = ((uint64_t)hash << 32) | h->b->num_records;
+    h->table_used++;
+    return true;
+  }
+
+  io_record_t *e = records + (uint32_t)*slot - 1;
+  rec[0] = *e;
+  io_record_t res;
+  if (!h->ext_options.int_reducer(&res, rec, 2, h->combine_bh,
+                                  h->ext_options.int_reducer_arg)) {
+    combine_remove(h, slot);
+    return true;
+  }
+  if (res.length <= e->length) {
+    memmove(e->record, res.record, res.length);
+    e->record[res.length] = 0;
+    e->length = res.length;
+    return true;
+  }
+  if (h->b->bp + res.length + 1 <= h->b->ep) {
+    char *ep = h->b->ep - (res.length + 1);
+    memmove(ep, res.record, res.length);
+    ep[res.length] = 0;
+    e->record = ep;
+    e->length = res.length;
+    h->b->ep = ep;
+    return true;
+  }
+
+  /* the result doesn't fit, write the buffer and start over with it */
+  char *bh = aml_buffer_data(h->combine_bh);
+  if (res.record < bh || res.record >= bh + aml_buffer_length(h->combine_bh))
+    aml_buffer_set(h->combine_bh, res.record, res.length);
+  else if (res.record != bh)
+    memmove(bh, res.record, res.length);
+  combine_remove(h, slot);
+  write_sorted(h);
+  combine_reset(h);
+  return write_combined_record(hp, aml_buffer_data(h->combine_bh),
+                               res.length);
+}
+
+/* sort and reduce the buffer and only keep the first limit records.  If
+   they use more than half of the buffer, stop limiting and write tmp files
+   as usual (the limit is still applied when reading). */
+static void limit_buffer(io_out_sorted_t *h) {
+  size_t limit = h->ext_options.limit;
+  io_in_t *in = _in_from_buffer(h, h->b);
+  if (!in)
+    return;
+  aml_buffer_t *bh = h->limit_bh;
+  aml_buffer_clear(bh);
+  size_t n = 0;
+  io_record_t *r;
+  while (n < limit && (r = io_in_advance(in)) != NULL) {
+    aml_buffer_append(bh, &(r->length), sizeof(r->length));
+    aml_buffer_append(bh, r->record, r->length);
+    n++;
+  }
+  io_in_destroy(in);
+
+  /* the buffer was cleared, copy the records back in order */
+  char *p = aml_buffer_data(bh);
+  char *ep = p + aml_buffer_length(bh);
+  while (p < ep) {
+    uint32_t length;
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    io_record_t rec;
+    stage_record(h, &rec, p, length);
+    add_staged_record(h, &rec);
+    p += length;
+  }
+
+  io_out_buffer_t *b = h->b;
+  if ((b->bp - b->buffer) + ((b->buffer + b->size) - b->ep) > b->size / 2) {
+    h->limit_full = false;
+    h->write_record = write_sorted_record;
+    return;
+  }
+  h->limit_full = n == limit;
+  if (h->limit_full)
+    h->limit_last = ((io_record_t *)b->buffer)[limit - 1];
+}
+
+static bool write_limited_record(io_out_t *hp, const void *d, size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
 
+  size_t length = len + sizeof(io_record_t) + 5;
+  if (h->b->bp + length > h->b->ep) {
+    limit_buffer(h);
+    if (h->write_record != write_limited_record)
+      return h->write_record(hp, d, len);
+    if (h->b->bp + length > h->b->ep)
+      return write_one_record(h, d, len);
+  }
+
+  io_record_t r;
+  stage_record(h, &r, d, len);
+  if (h->limit_full) {
+    int n = h->ext_options.int_compare(&r, &(h->limit_last),
+                                       h->ext_options.int_compare_arg);
+    /* equal records are kept if they can be reduced */
+    if (n > 0 || (n == 0 && !h->ext_options.int_reducer))
+      return true;
+  }
+  add_staged_record(h, &r);
   return true;
 }
 
-void io_out_ext_remove_tmp_files(char *tmp, const char *filename,
+/* Each record is charged for its own allocation (with up to 32 bytes of
+   allocator overhead) and for two heap slots, since the heap doubles as it
+   grows.  This is more than write_sorted_record charges, so records which
+   are all still in the heap always fit in the sort buffer. */
+static const size_t RS_ALLOC_OVERHEAD = 32;
+
+static inline size_t rs_record_bytes(const io_out_rs_record_t *r) {
+  return r->r.length + 1 + RS_ALLOC_OVERHEAD +
+         (2 * sizeof(io_out_rs_record_t));
+}
+
+static inline bool rs_less(io_out_sorted_t *h, const io_out_rs_record_t *a,
+                           const io_out_rs_record_t *b) {
+  if (a->run != b->run)
+    return a->run < b->run;
+  return h->ext_options.int_compare(&a->r, &b->r,
+                                    h->ext_options.int_compare_arg) < 0;
+}
+
+static void rs_push(io_out_sorted_t *h, io_out_rs_record_t *r) {
+  if (h->num_heap == h->heap_size) {
+    h->heap_size = h->heap_size ? h->heap_size * 2 : 1024;
+    h->heap = (io_out_rs_record_t *)aml_realloc(
+        h->heap, sizeof(io_out_rs_record_t) * h->heap_size);
+  }
+  io_out_rs_record_t *heap = h->heap;
+  size_t i = h->num_heap++;
+  while (i) {
+    size_t p = (i - 1) >> 1;
+    if (!rs_less(h, r, heap + p))
+      break;
+    heap[i] = heap[p];
+    i = p;
+  }
+  heap[i] = *r;
+  h->heap_bytes += rs_record_bytes(r);
+}
+
+static void rs_pop(io_out_sorted_t *h, io_out_rs_record_t *res) {
+  io_out_rs_record_t *heap = h->heap;
+  *res = heap[0];
+  h->heap_bytes -= rs_record_bytes(res);
+  h->num_heap--;
+  io_out_rs_record_t r = heap[h->num_heap];
+  size_t n = h->num_heap;
+  size_t i = 0;
+  while (true) {
+    size_t c = (i << 1) + 1;
+    if (c >= n)
+      break;
+    if (c + 1 < n && rs_less(h, heap + c + 1, heap + c))
+      c++;
+    if (!rs_less(h, heap + c, &r))
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = r;
+}
+
+static void rs_end_run(io_out_sorted_t *h) {
+  if (!h->run_out)
+    return;
+  io_out_destroy(h->run_out);
+  h->run_out = NULL;
+  if (h->ext_options.num_per_group)
+    check_for_merge(h);
+}
+
+/* write the smallest record to the current run, starting a new run if the
+   smallest record belongs to the next run */
+static void rs_write_smallest(io_out_sorted_t *h) {
+  io_out_rs_record_t r;
+  rs_pop(h, &r);
+  if (r.run != h->run) {
+    rs_end_run(h);
+    h->run = r.run;
+    h->runs_unordered = true;
+  }
+  if (!h->run_out)
+    h->run_out = get_next_tmp(h, false);
+  io_out_write_record(h->run_out, r.r.record, r.r.length);
+  if (h->last.r.record)
+    aml_free(h->last.r.record);
+  h->last = r;
+}
+
+static bool write_rs_record(io_out_t *hp, const void *d, size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
+
+  io_out_rs_record_t r;
+  r.r.length = len;
+  r.r.tag = h->tag;
+  while (h->num_heap &&
+         h->heap_bytes + rs_record_bytes(&r) > h->max_heap_bytes)
+    rs_write_smallest(h);
+
+  r.r.record = (char *)aml_malloc(len + 1);
+  memcpy(r.r.record, d, len);
+  r.r.record[len] = 0;
+  /* records smaller than the last one written must wait for the next run */
+  r.run = h->run;
+  if (h->last.r.record &&
+      h->ext_options.int_compare(&r.r, &h->last.r,
+                                 h->ext_options.int_compare_arg) < 0)
+    r.run++;
+  rs_push(h, &r);
+  return true;
+}
+
+/* Either all of the records are still in memory and are copied into the
+   buffer to be sorted, or the remaining records are written as the last
+   runs. */
+static void rs_finish(io_out_sorted_t *h) {
+  if (!h->last.r.record) {
+    init_buffer(&h->buf1, h->buf1.size);
+    for (size_t i = 0; i < h->num_heap; i++) {
+      h->tag = h->heap[i].r.tag;
+      write_sorted_record((io_out_t *)h, h->heap[i].r.record,
+                          h->heap[i].r.length);
+      aml_free(h->heap[i].r.record);
+    }
+    h->num_heap = 0;
+  } else {
+    while (h->num_heap)
+      rs_write_smallest(h);
+    rs_end_run(h);
+    aml_free(h->last.r.record);
+    h->last.r.record = NULL;
+    if (h->ext_options.num_per_group && h->num_group_written) {
+      h->ext_options.num_per_group = h->num_group_written;
+      check_for_merge(h);
+    }
+  }
+  if (h->heap)
+    aml_free(h->heap);
+  h->heap = NULL;
+  h->replacement_selection = false;
+}
+
+void io_out_ext_remove_tmp_files(char *tmp, io_out_sorted_t *h,
                                  bool lz4_tmp) {
   const char *suffix = lz4_tmp ? ".lz4" : "";
   uint32_t skipped = 0;
   for (uint32_t i = 0; skipped < 4; i++) {
-    tmp_filename(tmp, filename, i, suffix);
+    tmp_filename(tmp, h, i, suffix);
     if (io_file_exists(tmp))
       remove(tmp);
     else
@@ -1430,7 +3757,7 @@ void io_out_ext_remove_tmp_files(char *tmp, const char *filename,
   }
   skipped = 0;
   for (uint32_t i = 0; skipped < 4; i++) {
-    group_tmp_filename(tmp, filename, i, suffix);
+    group_tmp_filename(tmp, h, i, suffix);
     if (io_file_exists(tmp))
       remove(tmp);
     else
@@ -1495,11 +3822,25 @@ void io_out_sorted_destroy(io_out_t *hp) {
     aml_free(h->buf2.buffer);
     h->buf2.buffer = NULL;
   }
-  io_out_ext_remove_tmp_files(h->tmp_filename, h->filename,
-                              h->ext_options.lz4_tmp);
+  /* merge passes remove their inputs, so there may be gaps in the tmp files */
+  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  for (size_t i = 0; i < h->num_written; i++) {
+    tmp_filename(h->tmp_filename, h, i, suffix);
+    remove(h->tmp_filename);
+  }
+  io_out_ext_remove_tmp_files(h->tmp_filename, h, h->ext_options.lz4_tmp);
   destroy_extra_ins(h);
   remove_extras(h);
   touch_extras(h);
+  if (h->last_run_record)
+    aml_free(h->last_run_record);
+  if (h->table)
+    aml_free(h->table);
+  if (h->combine_bh)
+    aml_buffer_destroy(h->combine_bh);
+  if (h->limit_bh)
+    aml_buffer_destroy(h->limit_bh);
+  destroy_local_mutexes(h->local_mutexes, 1);
 
   extra_t *extra = h->extras;
   while (extra) {
@@ -1511,11 +3852,15 @@ void io_out_sorted_destroy(io_out_t *hp) {
   aml_free(h);
 }
 
+static void io_out_local_destroy(io_out_t *hp);
+
 static void io_out_ext_destroy(io_out_t *hp) {
   if (hp->type == IO_OUT_PARTITIONED_TYPE)
     io_out_partitioned_destroy(hp);
   else if (hp->type == IO_OUT_SORTED_TYPE)
     io_out_sorted_destroy(hp);
+  else if (hp->type == IO_OUT_LOCAL_TYPE)
+    io_out_local_destroy(hp);
   else
     abort();
 }
@@ -1528,6 +3873,14 @@ io_out_t *io_out_ext_init(const char *filename, io_out_options_t *options,
   else
     eopts = *ext_options;
 
+  /* fixed length records can be sorted with only a fixed_compare, the
+     sorted writer points the compare arg at its own options */
+  if (eopts.fixed_compare && !eopts.compare && options &&
+      options->format > 0) {
+    eopts.compare = _fixed_record_compare;
+    eopts.compare_arg = NULL;
+  }
+
   if (!eopts.int_compare) {
     eopts.int_compare = eopts.compare;
     eopts.int_compare_arg = eopts.compare_arg;
@@ -1547,3 +3900,192 @@ io_out_t *io_out_ext_init(const char *filename, io_out_options_t *options,
     return io_out_partitioned_init(filename, options, ext_options);
   return io_out_init(filename, options);
 }
+
+/** io_out_local_t **/
+static const size_t LOCAL_BUFFER_SIZE = 1024 * 1024;
+
+typedef struct {
+  int type;
+  io_out_options_t options;
+  io_out_write_cb write_record;
+
+  io_out_t *out;
+  pthread_mutex_t *mutexes;
+
+  /* length prefixed records */
+  aml_buffer_t *bh;
+  size_t num_records;
+
+  /* records are grouped by partition (once the sample is finished) so that
+     each partition is locked once per flush */
+  bool routed;
+  size_t num_partitions;
+  size_t *counts;
+  aml_buffer_t *order_bh;
+} io_out_local_t;
+
+static inline uint32_t local_length(const char *p) {
+  uint32_t length;
+  memcpy(&length, p, sizeof(length));
+  return length;
+}
+
+static bool write_local_records(io_out_local_t *h, io_out_t *out) {
+  bool ok = true;
+  char *p = aml_buffer_data(h->bh);
+  char *ep = p + aml_buffer_length(h->bh);
+  while (p < ep) {
+    uint32_t length = local_length(p);
+    if (!out->write_record(out, p + 4, length))
+      ok = false;
+    p += 4 + length;
+  }
+  return ok;
+}
+
+static bool flush_partitioned_local(io_out_local_t *h) {
+  io_out_partitioned_t *o = (io_out_partitioned_t *)h->out;
+  size_t num_partitions = h->num_partitions;
+  if (!h->routed) {
+    /* the records are written through the partitioned writer until the
+       range partitioning sample is finished */
+    pthread_mutex_t *m = h->mutexes + num_partitions;
+    pthread_mutex_lock(m);
+    bool ok = true;
+    if (o->write_record != write_partitioned_record)
+      ok = write_local_records(h, h->out);
+    else
+      h->routed = true;
+    pthread_mutex_unlock(m);
+    if (!h->routed || !ok)
+      return ok;
+  }
+
+  /* a counting sort of the record offsets by partition */
+  aml_buffer_resize(h->order_bh, sizeof(uint32_t) * h->num_records * 2);
+  uint32_t *parts = (uint32_t *)aml_buffer_data(h->order_bh);
+  uint32_t *order = parts + h->num_records;
+  size_t *counts = h->counts;
+  memset(counts, 0, sizeof(size_t) * (num_partitions + 1));
+
+  bool ok = true;
+  char *base = aml_buffer_data(h->bh);
+  char *p = base;
+  io_record_t r;
+  r.tag = 0;
+  for (size_t i = 0; i < h->num_records; i++) {
+    r.length = local_length(p);
+    r.record = p + 4;
+    size_t partition = o->partition(&r, num_partitions, o->partition_arg);
+    if (partition >= num_partitions) {
+      ok = false;
+      partition = num_partitions;
+    }
+    parts[i] = partition;
+    counts[partition]++;
+    p += 4 + r.length;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i <= num_partitions; i++) {
+    size_t n = counts[i];
+    counts[i] = offset;
+    offset += n;
+  }
+  p = base;
+  for (size_t i = 0; i < h->num_records; i++) {
+    order[counts[parts[i]]++] = p - base;
+    p += 4 + local_length(p);
+  }
+
+  /* counts[i] is now the end of partition i */
+  uint32_t *op = order;
+  for (size_t i = 0; i < num_partitions; i++) {
+    uint32_t *ep = order + counts[i];
+    if (op == ep)
+      continue;
+    io_out_t *out = o->partitions[i];
+    pthread_mutex_lock(h->mutexes + i);
+    for (; op < ep; op++) {
+      p = base + *op;
+      if (!out->write_record(out, p + 4, local_length(p)))
+        ok = false;
+    }
+    pthread_mutex_unlock(h->mutexes + i);
+  }
+  return ok;
+}
+
+static bool flush_local(io_out_local_t *h) {
+  if (!h->num_records)
+    return true;
+  bool ok;
+  if (h->out->type == IO_OUT_PARTITIONED_TYPE)
+    ok = flush_partitioned_local(h);
+  else {
+    pthread_mutex_lock(h->mutexes);
+    ok = write_local_records(h, h->out);
+    pthread_mutex_unlock(h->mutexes);
+  }
+  aml_buffer_clear(h->bh);
+  h->num_records = 0;
+  return ok;
+}
+
+static bool write_local_record(io_out_t *hp, const void *d, size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  io_out_local_t *h = (io_out_local_t *)hp;
+  uint32_t length = len;
+  aml_buffer_append(h->bh, &length, sizeof(length));
+  aml_buffer_append(h->bh, d, len);
+  h->num_records++;
+  if (aml_buffer_length(h->bh) >= LOCAL_BUFFER_SIZE)
+    return flush_local(h);
+  return true;
+}
+
+io_out_t *io_out_thread_local(io_out_t *hp) {
+  size_t num_mutexes = 1;
+  size_t num_partitions = 0;
+  pthread_mutex_t **mutexes = &(hp->local_mutexes);
+  if (hp->type == IO_OUT_PARTITIONED_TYPE) {
+    io_out_partitioned_t *p = (io_out_partitioned_t *)hp;
+    num_partitions = p->num_partitions;
+    num_mutexes = num_partitions + 1;
+    mutexes = &(p->local_mutexes);
+  } else if (hp->type == IO_OUT_SORTED_TYPE)
+    mutexes = &(((io_out_sorted_t *)hp)->local_mutexes);
+  else if (hp->type != IO_OUT_NORMAL_TYPE)
+    abort();
+
+  if (!*mutexes) {
+    *mutexes =
+        (pthread_mutex_t *)aml_malloc(sizeof(pthread_mutex_t) * num_mutexes);
+    for (size_t i = 0; i < num_mutexes; i++)
+      pthread_mutex_init(*mutexes + i, NULL);
+  }
+
+  io_out_local_t *h = (io_out_local_t *)aml_zalloc(
+      sizeof(io_out_local_t) + (sizeof(size_t) * (num_partitions + 1)));
+  h->type = IO_OUT_LOCAL_TYPE;
+  h->options = hp->options;
+  h->write_record = write_local_record;
+  h->out = hp;
+  h->mutexes = *mutexes;
+  h->bh = aml_buffer_init(LOCAL_BUFFER_SIZE + 1024);
+  h->num_partitions = num_partitions;
+  if (num_partitions) {
+    h->counts = (size_t *)(h + 1);
+    h->order_bh = aml_buffer_init(1024);
+  }
+  return (io_out_t *)h;
+}
+
+static void io_out_local_destroy(io_out_t *hp) {
+  io_out_local_t *h = (io_out_local_t *)hp;
+  flush_local(h);
+  aml_buffer_destroy(h->bh);
+  if (h->order_bh)
+    aml_buffer_destroy(h->order_bh);
+  aml_free(h);
+}
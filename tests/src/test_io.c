@@ -228,6 +228,92 @@ MACRO_TEST(io_sort_records_and_hash_partition) {
     MACRO_ASSERT_TRUE(part < 7);
 }
 
+static int cmp_bytes_records(const io_record_t *a, const io_record_t *b,
+                             void *arg) {
+    (void)arg;
+    uint32_t m = a->length < b->length ? a->length : b->length;
+    int c = memcmp(a->record, b->record, m);
+    if (c) return c;
+    return a->length < b->length ? -1 : (a->length > b->length ? 1 : 0);
+}
+
+MACRO_TEST(io_sort_records_by_prefix_matches_sort) {
+    /* short keys, keys sharing long prefixes and duplicates */
+    enum { N = 2000 };
+    char *data = (char *)aml_malloc(N * 24);
+    io_record_t a[N], b[N];
+    uint32_t x = 12345;
+    for (size_t i = 0; i < N; i++) {
+        x = x * 1103515245 + 12345;
+        char *p = data + i * 24;
+        int len = snprintf(p, 24, "%s%u", (x >> 8) % 3 ? "common-prefix-" : "",
+                           (x >> 16) % 500);
+        a[i].record = p;
+        a[i].length = len % 3 == 0 ? len : len - 1;
+        a[i].tag = (int32_t)i;
+        b[i] = a[i];
+    }
+    io_sort_records(a, N, cmp_bytes_records, NULL);
+    io_sort_records_by_prefix(b, N, cmp_bytes_records, NULL,
+                              io_bytes_key_prefix, NULL);
+    for (size_t i = 0; i < N; i++) {
+        MACRO_ASSERT_TRUE(cmp_bytes_records(a + i, b + i, NULL) == 0);
+        if (i)
+            MACRO_ASSERT_TRUE(cmp_bytes_records(b + i - 1, b + i, NULL) <= 0);
+    }
+    aml_free(data);
+}
+
+static int cmp_u64_records(const io_record_t *a, const io_record_t *b, void *tag) {
+    (void)tag;
+    return io_compare_uint64_t(a, b, NULL);
+}
+
+MACRO_TEST(io_sort_records_radix_matches_sort) {
+    /* enough records that buckets are radix sorted and not only insertion sorted */
+    enum { N = 5000 };
+    char *data = (char *)aml_malloc(N * 24);
+    uint64_t *keys = (uint64_t *)aml_malloc(N * sizeof(uint64_t));
+    io_record_t a[N], b[N], c[N], d[N];
+    uint32_t x = 777;
+    for (size_t i = 0; i < N; i++) {
+        x = x * 1103515245 + 12345;
+        char *p = data + i * 24;
+        int len = snprintf(p, 24, "%s%u", (x >> 8) % 3 ? "common-prefix-" : "",
+                           (x >> 16) % 700);
+        a[i].record = p;
+        a[i].length = len % 3 == 0 ? len : len - 1;
+        a[i].tag = (int32_t)i;
+        b[i] = a[i];
+
+        keys[i] = ((uint64_t)x << 20) ^ ((x >> 16) % 900);
+        c[i].record = (char *)(keys + i);
+        c[i].length = sizeof(uint64_t);
+        c[i].tag = (int32_t)i;
+        d[i] = c[i];
+    }
+    io_sort_records(a, N, cmp_bytes_records, NULL);
+    io_sort_records_radix(b, N, io_radix_bytes);
+    io_sort_records(c, N, cmp_u64_records, NULL);
+    io_sort_records_radix(d, N, io_radix_uint64);
+    for (size_t i = 0; i < N; i++) {
+        MACRO_ASSERT_TRUE(cmp_bytes_records(a + i, b + i, NULL) == 0);
+        MACRO_ASSERT_TRUE(cmp_u64_records(c + i, d + i, NULL) == 0);
+    }
+
+    /* 32 bit keys (the low half of the 64 bit keys on little endian) */
+    for (size_t i = 0; i < N; i++) {
+        c[i].length = sizeof(uint32_t);
+        d[i] = c[i];
+    }
+    io_sort_records(c, N, cmp_u32_records, NULL);
+    io_sort_records_radix(d, N, io_radix_uint32);
+    for (size_t i = 0; i < N; i++)
+        MACRO_ASSERT_TRUE(cmp_u32_records(c + i, d + i, NULL) == 0);
+    aml_free(keys);
+    aml_free(data);
+}
+
 /* --- runner --- */
 int main(void) {
     macro_test_case tests[64];
@@ -238,6 +324,8 @@ int main(void) {
     MACRO_ADD(tests, io_read_file_and_chunks);
     MACRO_ADD(tests, io_list_and_sort_file_info);
     MACRO_ADD(tests, io_sort_records_and_hash_partition);
+    MACRO_ADD(tests, io_sort_records_by_prefix_matches_sort);
+    MACRO_ADD(tests, io_sort_records_radix_matches_sort);
 
     macro_run_all("the-io-library/io.h", tests, test_count);
     return 0;
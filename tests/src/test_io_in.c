@@ -6,10 +6,13 @@
 #include "the-macro-library/macro_test.h"
 
 #include "the-io-library/io_in.h"
+#include "the-io-library/io_in_base.h"
 #include "the-io-library/io.h"
+#include "the-io-library/io_out.h"
 #include "a-memory-library/aml_alloc.h"
 #include "a-memory-library/aml_pool.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -157,6 +160,435 @@ MACRO_TEST(io_in_ext_merge_and_unique) {
     io_in_destroy(ext); /* should also close individual streams */
 }
 
+static io_in_t *many_inputs_ext(size_t num_inputs, size_t *counts,
+                                size_t num_keys, io_in_options_t *o) {
+    io_in_t *ext = io_in_ext_init(cmp_records, NULL, o);
+    for (size_t i = 0; i < num_inputs; i++) {
+        char *buf = (char *)aml_malloc(num_keys * 8 + 1);
+        size_t len = 0;
+        for (size_t j = 0; j < num_keys; j++) {
+            /* some keys appear twice in a stream, many in several streams */
+            size_t reps = ((j * (i + 3)) % 7) < 3 ? 1 : 0;
+            if (reps && (j + i) % 11 == 0)
+                reps++;
+            for (size_t k = 0; k < reps; k++) {
+                len += snprintf(buf + len, 8, "%03zu\n", j);
+                counts[j]++;
+            }
+        }
+        io_in_t *in = io_in_init_with_buffer(buf, len, true, o);
+        io_in_ext_add(ext, in, (int)i);
+    }
+    return ext;
+}
+
+MACRO_TEST(io_in_ext_merge_many_inputs) {
+    enum { NUM_INPUTS = 37, NUM_KEYS = 200 };
+    io_in_options_t o; io_in_options_init(&o);
+    io_in_options_format(&o, io_delimiter('\n'));
+
+    /* every record in order, equal records in the order inputs were added */
+    size_t counts[NUM_KEYS] = {0};
+    io_in_t *ext = many_inputs_ext(NUM_INPUTS, counts, NUM_KEYS, &o);
+    size_t seen[NUM_KEYS] = {0};
+    long last_key = -1, last_tag = -1;
+    io_record_t *r;
+    while ((r = io_in_advance(ext)) != NULL) {
+        long key = atol(r->record);
+        MACRO_ASSERT_TRUE(key >= last_key);
+        if (key == last_key)
+            MACRO_ASSERT_TRUE(r->tag >= last_tag);
+        last_key = key;
+        last_tag = r->tag;
+        seen[key]++;
+    }
+    for (size_t j = 0; j < NUM_KEYS; j++)
+        MACRO_ASSERT_EQ_SZ(seen[j], counts[j]);
+    io_in_destroy(ext);
+
+    /* groups hold one record from each input which is equal */
+    memset(counts, 0, sizeof(counts));
+    memset(seen, 0, sizeof(seen));
+    ext = many_inputs_ext(NUM_INPUTS, counts, NUM_KEYS, &o);
+    size_t num_r;
+    last_key = -1;
+    while ((r = io_in_advance_unique(ext, &num_r)) != NULL) {
+        long key = atol(r->record);
+        MACRO_ASSERT_TRUE(key >= last_key);
+        bool tags[NUM_INPUTS] = {false};
+        for (size_t i = 0; i < num_r; i++) {
+            MACRO_ASSERT_TRUE(atol(r[i].record) == key);
+            MACRO_ASSERT_TRUE(!tags[r[i].tag]);
+            tags[r[i].tag] = true;
+        }
+        /* a group only repeats a key if some stream holds it twice */
+        if (key > last_key) {
+            size_t in_streams = 0;
+            for (size_t i = 0; i < NUM_INPUTS; i++)
+                in_streams += ((key * (i + 3)) % 7) < 3 ? 1 : 0;
+            MACRO_ASSERT_EQ_SZ(num_r, in_streams);
+        }
+        last_key = key;
+        seen[key] += num_r;
+    }
+    for (size_t j = 0; j < NUM_KEYS; j++)
+        MACRO_ASSERT_EQ_SZ(seen[j], counts[j]);
+    io_in_destroy(ext);
+}
+
+MACRO_TEST(io_in_mmap_matches_read) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, "mapped.txt");
+
+    /* a file which ends exactly on a page boundary without a trailing
+       delimiter, so the final zero terminator lands past the file */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *data = (char *)aml_malloc(page);
+    for (size_t i = 0; i < page; i++)
+        data[i] = (i % 10 == 9) ? '\n' : 'a' + (i % 10);
+    write_file(f, data, page);
+    aml_free(data);
+
+    io_in_options_t o; io_in_options_init(&o);
+    io_in_options_buffer_size(&o, 256);
+    io_in_options_format(&o, io_delimiter('\n'));
+    io_in_options_allow_partial_records(&o);
+    io_in_options_mmap(&o);
+
+    io_in_t *in = io_in_init(f, &o);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0, bytes = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        MACRO_ASSERT_TRUE(r->record[r->length] == 0);
+        n++;
+        bytes += r->length;
+    }
+    io_in_destroy(in);
+    MACRO_ASSERT_EQ_SZ(n, (page + 9) / 10);
+    MACRO_ASSERT_EQ_SZ(bytes + page / 10, page);
+
+    /* pipes cannot be mapped and fall back to read() */
+    int fds[2];
+    MACRO_ASSERT_TRUE(pipe(fds) == 0);
+    MACRO_ASSERT_TRUE(write(fds[1], "x\ny\n", 4) == 4);
+    close(fds[1]);
+    io_in_t *pin = io_in_init_with_fd(fds[0], true, &o);
+    MACRO_ASSERT_TRUE(pin != NULL);
+    MACRO_ASSERT_EQ_SZ(io_in_count(pin), 2); /* count closes the cursor */
+
+    unlink(f); rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_in_csv_quoted_delimiters) {
+    /* newlines inside quotes (including next to escaped quotes) are part of
+       the record; long enough to cross several 64 byte blocks */
+    const char src[] =
+        "id,\"multi\nline\",x\n"
+        "2,\"escaped \"\"quote\"\"\n still quoted\",yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy\n"
+        "\"\"\n"
+        "3,\"\"\"\"\n";
+    io_in_options_t o; io_in_options_init(&o);
+    io_in_options_format(&o, io_csv_delimiter('\n'));
+
+    io_in_t *in = io_in_init_with_buffer((void*)src, sizeof(src)-1, false, &o);
+    MACRO_ASSERT_TRUE(in != NULL);
+    io_record_t *r = io_in_advance(in);
+    MACRO_ASSERT_TRUE(r && r->length == strlen("id,\"multi\nline\",x"));
+    r = io_in_advance(in);
+    MACRO_ASSERT_TRUE(r && r->record[0] == '2' && r->record[r->length-1] == 'y');
+    r = io_in_advance(in);
+    MACRO_ASSERT_TRUE(r && r->length == 2);
+    r = io_in_advance(in);
+    MACRO_ASSERT_TRUE(r && r->length == 6);
+    MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+    io_in_destroy(in);
+}
+
+MACRO_TEST(io_in_split_record_aligned) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, "split.txt");
+
+    /* records of varying length so range ends fall mid record */
+    char data[8192];
+    size_t len = 0, num_records = 0, total = 0;
+    while (len < sizeof(data) - 64) {
+        size_t l = (num_records * 7) % 23;
+        for (size_t i = 0; i < l; i++)
+            data[len++] = 'a' + (num_records % 26);
+        data[len++] = '\n';
+        total += l;
+        num_records++;
+    }
+    write_file(f, data, len);
+
+    io_in_options_t o; io_in_options_init(&o);
+    io_in_options_format(&o, io_delimiter('\n'));
+    io_in_options_buffer_size(&o, 100);
+    for (int mm = 0; mm < 2; mm++) {
+        if (mm)
+            io_in_options_mmap(&o);
+        for (size_t n = 1; n <= 9; n += 4) {
+            io_in_t **parts = io_in_split(f, &o, n);
+            MACRO_ASSERT_TRUE(parts != NULL);
+            size_t count = 0, bytes = 0;
+            for (size_t i = 0; i < n; i++) {
+                io_record_t *r;
+                while ((r = io_in_advance(parts[i])) != NULL) {
+                    /* every record is whole and uniform */
+                    for (size_t j = 1; j < r->length; j++)
+                        MACRO_ASSERT_TRUE(r->record[j] == r->record[0]);
+                    MACRO_ASSERT_EQ_SZ(r->length, (count * 7) % 23);
+                    count++;
+                    bytes += r->length;
+                }
+                io_in_destroy(parts[i]);
+            }
+            aml_free(parts);
+            MACRO_ASSERT_EQ_SZ(count, num_records);
+            MACRO_ASSERT_EQ_SZ(bytes, total);
+        }
+    }
+
+    unlink(f); rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_in_lz4_decompress_threads) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, "blocks.lz4");
+
+    /* enough 64k blocks to cycle through every job several times */
+    io_out_options_t oo; io_out_options_init(&oo);
+    io_out_options_format(&oo, io_delimiter('\n'));
+    io_out_options_lz4(&oo, 1, s64kb, false, false);
+    io_out_t *out = io_out_init(f, &oo);
+    MACRO_ASSERT_TRUE(out != NULL);
+    char buf[32];
+    const size_t num_records = 200000;
+    for (size_t i = 0; i < num_records; i++) {
+        int len = snprintf(buf, sizeof(buf), "record-%zu", i);
+        io_out_write_record(out, buf, len);
+    }
+    io_out_destroy(out);
+
+    io_in_options_t o; io_in_options_init(&o);
+    io_in_options_format(&o, io_delimiter('\n'));
+    io_in_options_decompress_threads(&o, 3);
+    io_in_t *in = io_in_init(f, &o);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        int len = snprintf(buf, sizeof(buf), "record-%zu", n);
+        MACRO_ASSERT_TRUE(r->length == (uint32_t)len &&
+                          !memcmp(r->record, buf, len));
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_records);
+    io_in_destroy(in);
+
+    unlink(f); rmdir(td); aml_free(td);
+}
+
+/* record i of the async files, lengths vary so blocks end mid record */
+static size_t async_record(size_t i, char *buf) {
+    size_t len = (i * 13) % 97;
+    for (size_t j = 0; j < len; j++)
+        buf[j] = 'a' + ((i + j) % 26);
+    return len;
+}
+
+static void write_async_file(const char *f, size_t num_records, bool async) {
+    io_out_options_t oo; io_out_options_init(&oo);
+    io_out_options_format(&oo, io_delimiter('\n'));
+    io_out_options_buffer_size(&oo, 1024 * 1024);
+    if (async)
+        io_out_options_async(&oo);
+    io_out_t *out = io_out_init(f, &oo);
+    MACRO_ASSERT_TRUE(out != NULL);
+    char buf[128];
+    for (size_t i = 0; i < num_records; i++)
+        MACRO_ASSERT_TRUE(io_out_write_record(out, buf, async_record(i, buf)));
+    io_out_destroy(out);
+}
+
+static void check_async_file(const char *f, size_t num_records, bool async) {
+    io_in_options_t o; io_in_options_init(&o);
+    io_in_options_format(&o, io_delimiter('\n'));
+    io_in_options_buffer_size(&o, 512 * 1024);
+    if (async)
+        io_in_options_async(&o);
+    io_in_t *in = io_in_init(f, &o);
+    MACRO_ASSERT_TRUE(in != NULL);
+    char buf[128];
+    size_t n = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        size_t len = async_record(n, buf);
+        MACRO_ASSERT_TRUE(r->length == len && !memcmp(r->record, buf, len));
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_records);
+    io_in_destroy(in);
+}
+
+MACRO_TEST(io_in_out_async_round_trip) {
+    char *td = mktempdir();
+    const char *names[] = {"async.txt", "async.lz4"};
+    /* about 6MB, many async blocks on both sides */
+    const size_t num_records = 120000;
+    for (size_t k = 0; k < 2; k++) {
+        char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, names[k]);
+        for (int w = 0; w < 2; w++) {
+            write_async_file(f, num_records, w);
+            for (int r = 0; r < 2; r++)
+                check_async_file(f, num_records, r);
+        }
+        unlink(f);
+    }
+
+    /* a file which is an exact number of read blocks, so the reads queued
+       past the end all come back empty */
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, "exact.bin");
+    const size_t size = 4 * 1024 * 1024;
+    char *data = (char *)aml_malloc(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char)((i * 7) >> 3);
+    write_file(f, data, size);
+    io_in_options_t o; io_in_options_init(&o);
+    io_in_options_format(&o, io_fixed(4096));
+    io_in_options_buffer_size(&o, 512 * 1024);
+    io_in_options_async(&o);
+    io_in_t *in = io_in_init(f, &o);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t pos = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        MACRO_ASSERT_TRUE(r->length == 4096 &&
+                          !memcmp(r->record, data + pos, 4096));
+        pos += 4096;
+    }
+    MACRO_ASSERT_EQ_SZ(pos, size);
+    MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+    io_in_destroy(in);
+    aml_free(data);
+    unlink(f);
+
+    /* caller descriptors stay open unless io_out owns them */
+    snprintf(f, sizeof(f), "%s/%s", td, "fd.txt");
+    int fd = open(f, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    MACRO_ASSERT_TRUE(fd >= 0);
+    io_out_options_t oo; io_out_options_init(&oo);
+    io_out_options_async(&oo);
+    io_out_t *out = io_out_init_with_fd(fd, false, &oo);
+    MACRO_ASSERT_TRUE(io_out_write(out, "abc", 3));
+    io_out_destroy(out);
+    MACRO_ASSERT_TRUE(fcntl(fd, F_GETFD) != -1);
+    out = io_out_init_with_fd(fd, true, &oo);
+    MACRO_ASSERT_TRUE(io_out_write(out, "def", 3));
+    io_out_destroy(out);
+    MACRO_ASSERT_TRUE(fcntl(fd, F_GETFD) == -1);
+    struct stat sb;
+    MACRO_ASSERT_TRUE(stat(f, &sb) == 0 && sb.st_size == 6);
+    unlink(f);
+
+    rmdir(td); aml_free(td);
+}
+
+static char *scalar_find(char *p, char *ep, char delim, bool csv) {
+    bool quoted = false;
+    for (; p < ep; p++) {
+        if (csv && *p == '\"')
+            quoted = !quoted;
+        else if (*p == delim && !quoted)
+            return p;
+    }
+    return p;
+}
+
+MACRO_TEST(io_in_find_delimiter_every_offset) {
+    /* the delimiter at every offset up to past two 64 byte blocks, with
+       the end of the range before, at and after it so the 16, 32 and 64
+       byte steps and their scalar tails all find it (or not) */
+    char buf[256];
+    for (size_t start = 0; start < 2; start++) {
+        for (size_t k = 0; k <= 130; k++) {
+            for (int csv = 0; csv < 2; csv++) {
+                char *p = buf + start;
+                memset(buf, 'x', sizeof(buf));
+                p[k] = ',';
+                if (csv && k > 2) {
+                    /* a quoted delimiter ahead of the real one */
+                    p[k / 3] = '\"';
+                    p[(k / 3) + 1] = ',';
+                    p[(2 * k) / 3 + 1] = '\"';
+                }
+                size_t ends[] = {k, k + 1, 200};
+                for (size_t e = 0; e < 3; e++) {
+                    char *ep = p + ends[e];
+                    MACRO_ASSERT_TRUE(
+                        io_in_base_find_delimiter(p, ep, ',', csv) ==
+                        scalar_find(p, ep, ',', csv));
+                }
+            }
+        }
+    }
+}
+
+MACRO_TEST(io_in_prefetch_matches_read) {
+    char *td = mktempdir();
+    const char *names[] = {"prefetch.txt", "prefetch.gz", "prefetch.lz4"};
+    const size_t num_records = 50000;
+    char buf[128];
+    for (size_t k = 0; k < 3; k++) {
+        char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, names[k]);
+        io_out_options_t oo; io_out_options_init(&oo);
+        io_out_options_format(&oo, io_delimiter('\n'));
+        io_out_t *out = io_out_init(f, &oo);
+        MACRO_ASSERT_TRUE(out != NULL);
+        for (size_t i = 0; i < num_records; i++) {
+            int len = snprintf(buf, sizeof(buf), "%zu-%.*s", i,
+                               (int)((i * 11) % 61), names[k]);
+            io_out_write_record(out, buf, len);
+        }
+        io_out_destroy(out);
+
+        /* small buffers so records cross many prefetched chunks (for lz4,
+           the base is moved by io_in_base_reinit after the header) */
+        io_in_options_t o; io_in_options_init(&o);
+        io_in_options_format(&o, io_delimiter('\n'));
+        io_in_options_buffer_size(&o, 1000);
+        for (size_t depth = 1; depth <= 4; depth += 3) {
+            io_in_options_t po = o;
+            io_in_options_prefetch(&po, depth);
+            io_in_t *in = io_in_init(f, &o);
+            io_in_t *pin = io_in_init(f, &po);
+            MACRO_ASSERT_TRUE(in != NULL && pin != NULL);
+            size_t n = 0;
+            io_record_t *r, *pr;
+            while ((r = io_in_advance(in)) != NULL) {
+                pr = io_in_advance(pin);
+                MACRO_ASSERT_TRUE(pr && pr->length == r->length &&
+                                  !memcmp(pr->record, r->record, r->length));
+                n++;
+            }
+            MACRO_ASSERT_TRUE(io_in_advance(pin) == NULL);
+            MACRO_ASSERT_EQ_SZ(n, num_records);
+            io_in_destroy(in);
+            io_in_destroy(pin);
+
+            /* the helper thread is stopped while it still has data */
+            pin = io_in_init(f, &po);
+            MACRO_ASSERT_TRUE(pin != NULL);
+            for (size_t i = 0; i < 100; i++)
+                MACRO_ASSERT_TRUE(io_in_advance(pin) != NULL);
+            io_in_destroy(pin);
+        }
+        unlink(f);
+    }
+    rmdir(td); aml_free(td);
+}
+
 /* --- runner --- */
 int main(void) {
     macro_test_case tests[64];
@@ -165,6 +597,14 @@ int main(void) {
     MACRO_ADD(tests, io_in_options_and_quick_init_delimited);
     MACRO_ADD(tests, io_in_with_buffer_and_records_init);
     MACRO_ADD(tests, io_in_ext_merge_and_unique);
+    MACRO_ADD(tests, io_in_ext_merge_many_inputs);
+    MACRO_ADD(tests, io_in_mmap_matches_read);
+    MACRO_ADD(tests, io_in_csv_quoted_delimiters);
+    MACRO_ADD(tests, io_in_find_delimiter_every_offset);
+    MACRO_ADD(tests, io_in_split_record_aligned);
+    MACRO_ADD(tests, io_in_lz4_decompress_threads);
+    MACRO_ADD(tests, io_in_prefetch_matches_read);
+    MACRO_ADD(tests, io_in_out_async_round_trip);
 
     macro_run_all("the-io-library/io_in.h", tests, test_count);
     return 0;
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <pthread.h>
 
 static char *mktempdir(void) {
     char buf[] = "/tmp/ioout_test_XXXXXX";
@@ -91,6 +92,1161 @@ MACRO_TEST(io_out_write_and_write_delimiter_with_fd_owner) {
     unlink(f); rmdir(td); aml_free(td);
 }
 
+MACRO_TEST(io_out_lz4_threads_matches_single_thread) {
+    char *td = mktempdir();
+    char f1[PATH_MAX]; path_join(f1, td, "single.lz4");
+    char f2[PATH_MAX]; path_join(f2, td, "threaded.lz4");
+
+    const size_t num_records = 100000;
+    char buf[32];
+    for (int pass = 0; pass < 2; pass++) {
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_delimiter('\n'));
+        io_out_options_lz4(&opt, 1, s64kb, false, false);
+        if (pass)
+            io_out_options_lz4_threads(&opt, 3);
+        io_out_t *out = io_out_init(pass ? f2 : f1, &opt);
+        MACRO_ASSERT_TRUE(out != NULL);
+        for (size_t i = 0; i < num_records; i++) {
+            int len = snprintf(buf, sizeof(buf), "%zu", i * 7919);
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+        }
+        io_out_destroy(out);
+    }
+
+    /* blocks are compressed the same way and written in order */
+    size_t len1 = 0, len2 = 0;
+    char *c1 = io_read_file(&len1, f1);
+    char *c2 = io_read_file(&len2, f2);
+    MACRO_ASSERT_EQ_SZ(len1, len2);
+    MACRO_ASSERT_TRUE(memcmp(c1, c2, len1) == 0);
+    aml_free(c1);
+    aml_free(c2);
+
+    io_in_t *in = io_in_quick_init(f2, io_delimiter('\n'), 1024);
+    MACRO_ASSERT_EQ_SZ(io_in_count(in), num_records);
+
+    unlink(f1); unlink(f2); rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_gz_threads_and_bgzf_read_back) {
+    char *td = mktempdir();
+    char f[PATH_MAX];
+
+    const size_t num_records = 100000;
+    char buf[32];
+    for (int bgzf = 0; bgzf < 2; bgzf++) {
+        path_join(f, td, bgzf ? "blocks.gz" : "members.gz");
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_delimiter('\n'));
+        io_out_options_gz(&opt, 6);
+        io_out_options_gz_threads(&opt, 3);
+        if (bgzf)
+            io_out_options_gz_bgzf(&opt);
+        io_out_t *out = io_out_init(f, &opt);
+        MACRO_ASSERT_TRUE(out != NULL);
+        for (size_t i = 0; i < num_records; i++) {
+            int len = snprintf(buf, sizeof(buf), "%zu", i * 7919);
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+        }
+        io_out_destroy(out);
+
+        if (bgzf) {
+            /* walk the blocks using the BSIZE of each block */
+            size_t len = 0, pos = 0, blocks = 0;
+            unsigned char *c = (unsigned char *)io_read_file(&len, f);
+            while (pos + 18 <= len) {
+                MACRO_ASSERT_TRUE(c[pos] == 0x1f && c[pos + 1] == 0x8b);
+                MACRO_ASSERT_TRUE(c[pos + 12] == 'B' && c[pos + 13] == 'C');
+                pos += (c[pos + 16] | (c[pos + 17] << 8)) + 1;
+                blocks++;
+            }
+            MACRO_ASSERT_EQ_SZ(pos, len);
+            MACRO_ASSERT_TRUE(blocks > 2);
+            /* the last block is the canonical empty eof block */
+            static const unsigned char eof[28] = {
+                0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+                0x06, 0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00,
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+            MACRO_ASSERT_TRUE(len > 28 && !memcmp(c + len - 28, eof, 28));
+            MACRO_ASSERT_TRUE(c[9] == 0xff);
+            aml_free(c);
+        }
+
+        io_in_t *in = io_in_quick_init(f, io_delimiter('\n'), 1024);
+        MACRO_ASSERT_TRUE(in != NULL);
+        size_t n = 0;
+        io_record_t *r;
+        while ((r = io_in_advance(in)) != NULL) {
+            int len = snprintf(buf, sizeof(buf), "%zu", n * 7919);
+            MACRO_ASSERT_TRUE(r->length == (uint32_t)len &&
+                              !memcmp(r->record, buf, len));
+            n++;
+        }
+        MACRO_ASSERT_EQ_SZ(n, num_records);
+        io_in_destroy(in);
+        unlink(f);
+    }
+
+    rmdir(td); aml_free(td);
+}
+
+static int cmp_bytes_records(const io_record_t *a, const io_record_t *b,
+                             void *arg) {
+    (void)arg;
+    uint32_t m = a->length < b->length ? a->length : b->length;
+    int c = memcmp(a->record, b->record, m);
+    if (c) return c;
+    return a->length < b->length ? -1 : (a->length > b->length ? 1 : 0);
+}
+
+MACRO_TEST(io_out_ext_sorted_with_key_prefix) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "sorted");
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+    io_out_options_buffer_size(&opt, 64 * 1024); /* several tmp files */
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+    io_out_ext_options_key_prefix(&x, io_bytes_key_prefix, NULL);
+
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    MACRO_ASSERT_TRUE(out != NULL);
+    const size_t num_records = 20000;
+    char buf[48];
+    uint32_t v = 1;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        /* many records share the first 8 bytes */
+        int len = snprintf(buf, sizeof(buf), "shared-prefix-%u", (v >> 8) % 5000);
+        MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+    }
+
+    io_in_t *in = io_out_in(out);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0;
+    char last[48] = "";
+    uint32_t last_len = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        io_record_t prev = { last, last_len, 0 };
+        MACRO_ASSERT_TRUE(cmp_bytes_records(&prev, r, NULL) <= 0);
+        memcpy(last, r->record, r->length);
+        last_len = r->length;
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_records);
+    io_in_destroy(in);
+
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_sorted_with_radix_sort) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "sorted");
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+    io_out_options_buffer_size(&opt, 64 * 1024); /* several tmp files */
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+    io_out_ext_options_radix_sort(&x, io_radix_bytes);
+
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    MACRO_ASSERT_TRUE(out != NULL);
+    const size_t num_records = 20000;
+    char buf[48];
+    uint32_t v = 7;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        int len = snprintf(buf, sizeof(buf), "%s%u", (v >> 4) % 2 ? "shared-prefix-" : "",
+                           (v >> 8) % 5000);
+        MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+    }
+
+    io_in_t *in = io_out_in(out);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0;
+    char last[48] = "";
+    uint32_t last_len = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        io_record_t prev = { last, last_len, 0 };
+        MACRO_ASSERT_TRUE(cmp_bytes_records(&prev, r, NULL) <= 0);
+        memcpy(last, r->record, r->length);
+        last_len = r->length;
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_records);
+    io_in_destroy(in);
+
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_sorted_with_sort_threads) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "sorted");
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+    /* each buffer holds enough records to be sorted by 4 threads */
+    io_out_options_buffer_size(&opt, 2 * 1024 * 1024);
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+    io_out_ext_options_sort_threads(&x, 4);
+
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    MACRO_ASSERT_TRUE(out != NULL);
+    const size_t num_records = 200000;
+    char buf[48];
+    uint32_t v = 11;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        int len = snprintf(buf, sizeof(buf), "%u", (v >> 8) % 50000);
+        MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+    }
+
+    io_in_t *in = io_out_in(out);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0;
+    char last[48] = "";
+    uint32_t last_len = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        io_record_t prev = { last, last_len, 0 };
+        MACRO_ASSERT_TRUE(cmp_bytes_records(&prev, r, NULL) <= 0);
+        memcpy(last, r->record, r->length);
+        last_len = r->length;
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_records);
+    io_in_destroy(in);
+
+    rmdir(td); aml_free(td);
+}
+
+static size_t write_and_check_sorted(io_out_t *out, bool nearly_sorted,
+                                     size_t num_records, const char *tmp0,
+                                     const char *tmp1, bool *single_run) {
+    char buf[48];
+    uint32_t v = 5;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        uint32_t k = nearly_sorted ? (uint32_t)i * 8 + (v >> 8) % 64 : (v >> 8) % 100000;
+        int len = snprintf(buf, sizeof(buf), "%010u", k);
+        if (!io_out_write_record(out, buf, len))
+            return 0;
+    }
+
+    io_in_t *in = io_out_in(out);
+    if (!in)
+        return 0;
+    *single_run = io_file_exists(tmp0) && !io_file_exists(tmp1);
+    size_t n = 0;
+    char last[48] = "";
+    uint32_t last_len = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        io_record_t prev = { last, last_len, 0 };
+        if (cmp_bytes_records(&prev, r, NULL) > 0)
+            break;
+        memcpy(last, r->record, r->length);
+        last_len = r->length;
+        n++;
+    }
+    io_in_destroy(in);
+    return n;
+}
+
+MACRO_TEST(io_out_ext_replacement_selection) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "sorted");
+    char tmp0[PATH_MAX]; path_join(tmp0, td, "sorted_0_tmp.lz4");
+    char tmp1[PATH_MAX]; path_join(tmp1, td, "sorted_1_tmp.lz4");
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+    io_out_options_buffer_size(&opt, 64 * 1024);
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+    io_out_ext_options_replacement_selection(&x);
+
+    const size_t num_records = 50000;
+    bool single_run = false;
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    MACRO_ASSERT_EQ_SZ(write_and_check_sorted(out, false, num_records, tmp0, tmp1,
+                                              &single_run), num_records);
+    MACRO_ASSERT_TRUE(!single_run);
+
+    /* nearly sorted input is written as a single run */
+    out = io_out_ext_init(f, &opt, &x);
+    MACRO_ASSERT_EQ_SZ(write_and_check_sorted(out, true, num_records, tmp0, tmp1,
+                                              &single_run), num_records);
+    MACRO_ASSERT_TRUE(single_run);
+
+    /* everything fits in memory */
+    out = io_out_ext_init(f, &opt, &x);
+    MACRO_ASSERT_EQ_SZ(write_and_check_sorted(out, false, 100, tmp0, tmp1,
+                                              &single_run), 100);
+    MACRO_ASSERT_TRUE(!io_file_exists(tmp0));
+
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_sorted_presorted_input) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "sorted");
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+    io_out_options_buffer_size(&opt, 64 * 1024); /* several tmp files */
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+    io_out_ext_options_reducer(&x, io_keep_first, NULL);
+
+    /* sorted input with duplicates which may span tmp files */
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    const size_t num_keys = 20000;
+    char buf[48];
+    for (size_t i = 0; i < num_keys; i++) {
+        int len = snprintf(buf, sizeof(buf), "%010zu", i);
+        for (size_t j = 0; j < 1 + i % 3; j++)
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+    }
+
+    io_in_t *in = io_out_in(out);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        snprintf(buf, sizeof(buf), "%010zu", n);
+        MACRO_ASSERT_TRUE(r->length == 10 && !memcmp(r->record, buf, 10));
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_keys);
+    io_in_destroy(in);
+
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_sorted_cascade_merge) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "sorted");
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+    io_out_options_buffer_size(&opt, 64 * 1024); /* many tmp files */
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+    io_out_ext_options_reducer(&x, io_keep_first, NULL);
+    io_out_ext_options_max_fan_in(&x, 3);
+    io_out_ext_options_merge_threads(&x, 2);
+
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    const size_t num_records = 60000, num_keys = 20000;
+    bool *seen = (bool *)aml_zalloc(num_keys * sizeof(bool));
+    size_t num_unique = 0;
+    char buf[48];
+    uint32_t v = 9;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        size_t k = (v >> 8) % num_keys;
+        if (!seen[k]) { seen[k] = true; num_unique++; }
+        int len = snprintf(buf, sizeof(buf), "%010zu", k);
+        MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+    }
+
+    io_in_t *in = io_out_in(out);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0;
+    char last[48] = "";
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        MACRO_ASSERT_TRUE(r->length == 10 && memcmp(last, r->record, 10) < 0);
+        memcpy(last, r->record, 10);
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_unique);
+    io_in_destroy(in);
+    aml_free(seen);
+
+    /* all of the tmp files are removed */
+    size_t num_files = 0;
+    io_file_info_t *files = io_list(td, &num_files, NULL, NULL);
+    MACRO_ASSERT_EQ_SZ(num_files, 0);
+    aml_free(files);
+
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_sorted_with_tmp_dirs) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "sorted");
+    char d0[PATH_MAX]; path_join(d0, td, "d0");
+    char d1[PATH_MAX]; path_join(d1, td, "d1");
+    MACRO_ASSERT_TRUE(io_make_directory(d0));
+    MACRO_ASSERT_TRUE(io_make_directory(d1));
+    char *dirs[] = {d0, d1};
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+    io_out_options_buffer_size(&opt, 64 * 1024); /* many tmp files */
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+    io_out_ext_options_tmp_dirs(&x, dirs, 2);
+
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    const size_t num_records = 20000;
+    char buf[48];
+    uint32_t v = 3;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        int len = snprintf(buf, sizeof(buf), "%010u", v >> 4);
+        MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+    }
+
+    io_in_t *in = io_out_in(out);
+    MACRO_ASSERT_TRUE(in != NULL);
+
+    /* the tmp files are split between the dirs and none are next to f */
+    size_t n0 = 0, n1 = 0, nt = 0;
+    io_file_info_t *files = io_list(d0, &n0, NULL, NULL);
+    aml_free(files);
+    files = io_list(d1, &n1, NULL, NULL);
+    aml_free(files);
+    MACRO_ASSERT_TRUE(n0 > 0 && n1 > 0);
+    MACRO_ASSERT_TRUE(n0 + 1 >= n1 && n1 + 1 >= n0);
+    files = io_list(td, &nt, NULL, NULL);
+    aml_free(files);
+    MACRO_ASSERT_EQ_SZ(nt, n0 + n1);
+
+    size_t n = 0;
+    char last[48] = "";
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        MACRO_ASSERT_TRUE(r->length == 10 && memcmp(last, r->record, 10) <= 0);
+        memcpy(last, r->record, 10);
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_records);
+    io_in_destroy(in);
+
+    files = io_list(td, &nt, NULL, NULL);
+    MACRO_ASSERT_EQ_SZ(nt, 0);
+    aml_free(files);
+
+    rmdir(d0); rmdir(d1);
+    rmdir(td); aml_free(td);
+}
+
+static int cmp_uint32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+MACRO_TEST(io_out_ext_sorted_with_limit) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "limited");
+
+    const size_t num_records = 100000;
+    uint32_t *values = (uint32_t *)aml_malloc(num_records * sizeof(uint32_t));
+    uint32_t v = 11;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        values[i] = v >> 4;
+    }
+    uint32_t *sorted = (uint32_t *)aml_malloc(num_records * sizeof(uint32_t));
+    memcpy(sorted, values, num_records * sizeof(uint32_t));
+    qsort(sorted, num_records, sizeof(uint32_t), cmp_uint32);
+
+    /* 100 records fit in the buffer, 50000 need tmp files */
+    const size_t limits[] = {100, 50000};
+    for (size_t t = 0; t < 2; t++) {
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_prefix());
+        io_out_options_buffer_size(&opt, 64 * 1024);
+
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+        io_out_ext_options_limit(&x, limits[t]);
+
+        io_out_t *out = io_out_ext_init(f, &opt, &x);
+        char buf[48];
+        for (size_t i = 0; i < num_records; i++) {
+            int len = snprintf(buf, sizeof(buf), "%010u", values[i]);
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+        }
+
+        size_t num_files = 0;
+        io_file_info_t *files = io_list(td, &num_files, NULL, NULL);
+        aml_free(files);
+        if (t == 0)
+            MACRO_ASSERT_EQ_SZ(num_files, 0);
+        else
+            MACRO_ASSERT_TRUE(num_files > 0);
+
+        io_in_t *in = io_out_in(out);
+        MACRO_ASSERT_TRUE(in != NULL);
+        size_t n = 0;
+        io_record_t *r;
+        while ((r = io_in_advance(in)) != NULL) {
+            snprintf(buf, sizeof(buf), "%010u", sorted[n]);
+            MACRO_ASSERT_TRUE(r->length == 10 && !memcmp(buf, r->record, 10));
+            n++;
+        }
+        MACRO_ASSERT_EQ_SZ(n, limits[t]);
+        io_in_destroy(in);
+    }
+    aml_free(values);
+    aml_free(sorted);
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_range_partitioned_output_is_globally_sorted) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "ranged");
+    char sample[PATH_MAX]; path_join(sample, td, "sample");
+    char part[PATH_MAX + 32];
+    const size_t num_partitions = 4, num_records = 50000;
+    char buf[48];
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_prefix());
+
+    /* a sample of the same distribution for the second pass */
+    io_out_t *out = io_out_init(sample, &opt);
+    uint32_t v = 17;
+    for (size_t i = 0; i < 1000; i++) {
+        v = v * 1103515245 + 12345;
+        int len = snprintf(buf, sizeof(buf), "%010u", v >> 4);
+        MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+    }
+    io_out_destroy(out);
+
+    for (size_t t = 0; t < 2; t++) {
+        io_out_options_buffer_size(&opt, 256 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+        io_out_ext_options_num_partitions(&x, num_partitions);
+        if (t == 0)
+            io_out_ext_options_range_partition(&x, 2000);
+        else
+            io_out_ext_options_range_sample_file(&x, sample, io_prefix());
+
+        out = io_out_ext_init(f, &opt, &x);
+        v = 5;
+        for (size_t i = 0; i < num_records; i++) {
+            v = v * 1103515245 + 12345;
+            int len = snprintf(buf, sizeof(buf), "%010u", v >> 4);
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+        }
+        io_out_destroy(out);
+
+        /* the partitions read in order are sorted */
+        io_in_options_t io;
+        io_in_options_init(&io);
+        io_in_options_format(&io, io_prefix());
+        size_t total = 0;
+        char last[48] = "";
+        for (size_t i = 0; i < num_partitions; i++) {
+            io_out_partition_filename(part, f, i);
+            io_in_t *in = io_in_init(part, &io);
+            size_t n = 0;
+            io_record_t *r;
+            while ((r = io_in_advance(in)) != NULL) {
+                MACRO_ASSERT_TRUE(r->length == 10 && memcmp(last, r->record, 10) <= 0);
+                memcpy(last, r->record, 10);
+                n++;
+            }
+            io_in_destroy(in);
+            MACRO_ASSERT_TRUE(n > num_records / num_partitions / 2);
+            total += n;
+            remove(part);
+        }
+        MACRO_ASSERT_EQ_SZ(total, num_records);
+    }
+    remove(sample);
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_partitioned_in_reads_partitions) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "parts");
+    const size_t num_records = 50000;
+    char buf[48];
+
+    /* unsorted, sorted after partitioning, sorted while partitioning and
+       range partitioned with buffers which spill and which don't */
+    for (size_t t = 0; t < 8; t++) {
+        size_t mode = t % 4;
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_prefix());
+        io_out_options_buffer_size(&opt, t < 4 ? 64 * 1024 : 16 * 1024 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_num_partitions(&x, 8);
+        io_out_ext_options_num_sort_threads(&x, 3);
+        if (mode == 3)
+            io_out_ext_options_range_partition(&x, 0);
+        else
+            io_out_ext_options_partition(&x, io_hash_partition, NULL);
+        if (mode > 0)
+            io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+        if (mode == 2)
+            io_out_ext_options_sort_while_partitioning(&x);
+
+        io_out_t *out = io_out_ext_init(f, &opt, &x);
+        uint32_t v = 11;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < num_records; i++) {
+            v = v * 1103515245 + 12345;
+            int len = snprintf(buf, sizeof(buf), "%010u", v >> 4);
+            sum += v >> 4;
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+        }
+
+        io_in_t *in = io_out_in(out);
+        MACRO_ASSERT_TRUE(in != NULL);
+        size_t n = 0;
+        char last[48] = "";
+        io_record_t *r;
+        while ((r = io_in_advance(in)) != NULL) {
+            MACRO_ASSERT_TRUE(r->length == 10);
+            if (mode > 0)
+                MACRO_ASSERT_TRUE(memcmp(last, r->record, 10) <= 0);
+            memcpy(last, r->record, 10);
+            last[10] = 0;
+            sum -= strtoul(last, NULL, 10);
+            n++;
+        }
+        io_in_destroy(in);
+        MACRO_ASSERT_EQ_SZ(n, num_records);
+        MACRO_ASSERT_TRUE(sum == 0);
+
+        /* no partition or tmp files are left behind */
+        MACRO_ASSERT_TRUE(rmdir(td) == 0);
+        MACRO_ASSERT_TRUE(mkdir(td, 0700) == 0);
+    }
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_bucketed_spill_partitions) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "bucketed");
+    char part[PATH_MAX + 32];
+    const size_t num_partitions = 200, num_records = 50000;
+    char buf[48];
+
+    /* unsorted and sorted, written to partition files or read with
+       io_out_in */
+    for (size_t t = 0; t < 4; t++) {
+        bool sorted = t & 1, use_in = t & 2;
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_prefix());
+        io_out_options_buffer_size(&opt, 64 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_num_partitions(&x, num_partitions);
+        io_out_ext_options_partition(&x, io_hash_partition, NULL);
+        io_out_ext_options_bucketed_spill(&x);
+        io_out_ext_options_num_sort_threads(&x, 2);
+        if (sorted)
+            io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+
+        io_out_t *out = io_out_ext_init(f, &opt, &x);
+        uint32_t v = 3;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < num_records; i++) {
+            v = v * 1103515245 + 12345;
+            int len = snprintf(buf, sizeof(buf), "%010u", v >> 4);
+            sum += v >> 4;
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+        }
+
+        size_t n = 0;
+        io_record_t *r;
+        if (use_in) {
+            io_in_t *in = io_out_in(out);
+            char last[48] = "";
+            while ((r = io_in_advance(in)) != NULL) {
+                MACRO_ASSERT_TRUE(r->length == 10);
+                if (sorted)
+                    MACRO_ASSERT_TRUE(memcmp(last, r->record, 10) <= 0);
+                memcpy(last, r->record, 10);
+                last[10] = 0;
+                sum -= strtoul(last, NULL, 10);
+                n++;
+            }
+            io_in_destroy(in);
+        } else {
+            io_out_destroy(out);
+            io_in_options_t io;
+            io_in_options_init(&io);
+            io_in_options_format(&io, io_prefix());
+            for (size_t i = 0; i < num_partitions; i++) {
+                io_out_partition_filename(part, f, i);
+                io_in_t *in = io_in_init(part, &io);
+                char last[48] = "";
+                while ((r = io_in_advance(in)) != NULL) {
+                    MACRO_ASSERT_TRUE(r->length == 10);
+                    MACRO_ASSERT_EQ_SZ(io_hash_partition(r, num_partitions, NULL), i);
+                    if (sorted)
+                        MACRO_ASSERT_TRUE(memcmp(last, r->record, 10) <= 0);
+                    memcpy(last, r->record, 10);
+                    last[10] = 0;
+                    sum -= strtoul(last, NULL, 10);
+                    n++;
+                }
+                io_in_destroy(in);
+                remove(part);
+            }
+        }
+        MACRO_ASSERT_EQ_SZ(n, num_records);
+        MACRO_ASSERT_TRUE(sum == 0);
+        /* the spill file is removed */
+        MACRO_ASSERT_TRUE(rmdir(td) == 0);
+        MACRO_ASSERT_TRUE(mkdir(td, 0700) == 0);
+    }
+    rmdir(td); aml_free(td);
+}
+
+/* most records go to the first partition */
+static size_t skewed_partition(const io_record_t *r, size_t num_part,
+                               void *arg) {
+    (void)arg;
+    size_t d = r->record[r->length - 1] - '0';
+    return d < 7 ? 0 : 1 + d % (num_part - 1);
+}
+
+/* the threads which compared records of the first partition */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_t threads[16];
+    size_t num_threads;
+} thread_tracker_t;
+
+static int cmp_tracked_records(const io_record_t *a, const io_record_t *b,
+                               void *arg) {
+    thread_tracker_t *t = (thread_tracker_t *)arg;
+    if (skewed_partition(a, 6, NULL) == 0) {
+        pthread_t self = pthread_self();
+        pthread_mutex_lock(&t->mutex);
+        size_t i = 0;
+        while (i < t->num_threads && !pthread_equal(t->threads[i], self))
+            i++;
+        if (i == t->num_threads && i < 16)
+            t->threads[t->num_threads++] = self;
+        pthread_mutex_unlock(&t->mutex);
+    }
+    return cmp_bytes_records(a, b, NULL);
+}
+
+MACRO_TEST(io_out_ext_skewed_partitions_are_sorted) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "skewed");
+    char part[PATH_MAX + 32];
+    const size_t num_partitions = 6;
+    char buf[48];
+    thread_tracker_t tracker;
+    pthread_mutex_init(&tracker.mutex, NULL);
+    tracker.num_threads = 0;
+
+    /* spilled and bucketed, then with buffers large enough to split so the
+       later buffers of the large partition borrow the threads which have
+       finished the small ones */
+    for (size_t t = 0; t < 3; t++) {
+        size_t num_records = t < 2 ? 60000 : 300000;
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_prefix());
+        io_out_options_buffer_size(&opt, t < 2 ? 256 * 1024 : 16 * 1024 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        if (t < 2)
+            io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+        else
+            io_out_ext_options_compare(&x, cmp_tracked_records, &tracker);
+        io_out_ext_options_num_partitions(&x, num_partitions);
+        io_out_ext_options_partition(&x, skewed_partition, NULL);
+        io_out_ext_options_num_sort_threads(&x, 4);
+        if (t == 1)
+            io_out_ext_options_bucketed_spill(&x);
+
+        io_out_t *out = io_out_ext_init(f, &opt, &x);
+        uint32_t v = 7;
+        for (size_t i = 0; i < num_records; i++) {
+            v = v * 1103515245 + 12345;
+            int len = snprintf(buf, sizeof(buf), "%010u", v >> 4);
+            MACRO_ASSERT_TRUE(io_out_write_record(out, buf, len));
+        }
+        io_out_destroy(out);
+
+        io_in_options_t io;
+        io_in_options_init(&io);
+        io_in_options_format(&io, io_prefix());
+        size_t total = 0, first = 0;
+        for (size_t i = 0; i < num_partitions; i++) {
+            io_out_partition_filename(part, f, i);
+            io_in_t *in = io_in_init(part, &io);
+            char last[48] = "";
+            io_record_t *r;
+            while ((r = io_in_advance(in)) != NULL) {
+                MACRO_ASSERT_EQ_SZ(skewed_partition(r, num_partitions, NULL), i);
+                MACRO_ASSERT_TRUE(memcmp(last, r->record, 10) <= 0);
+                memcpy(last, r->record, 10);
+                total++;
+                if (i == 0)
+                    first++;
+            }
+            io_in_destroy(in);
+            remove(part);
+        }
+        MACRO_ASSERT_EQ_SZ(total, num_records);
+        MACRO_ASSERT_TRUE(first > num_records / 2);
+        MACRO_ASSERT_TRUE(rmdir(td) == 0);
+        MACRO_ASSERT_TRUE(mkdir(td, 0700) == 0);
+    }
+    /* the sort thread and at least one lent thread */
+    MACRO_ASSERT_TRUE(tracker.num_threads > 1);
+    pthread_mutex_destroy(&tracker.mutex);
+    rmdir(td); aml_free(td);
+}
+
+typedef struct {
+    io_out_t *out;
+    uint32_t seed;
+    size_t num_records;
+} local_writer_t;
+
+static void *write_thread_local(void *arg) {
+    local_writer_t *w = (local_writer_t *)arg;
+    char buf[48];
+    uint32_t v = w->seed;
+    for (size_t i = 0; i < w->num_records; i++) {
+        v = v * 1103515245 + 12345;
+        int len = snprintf(buf, sizeof(buf), "%010u", v >> 4);
+        MACRO_ASSERT_TRUE(io_out_write_record(w->out, buf, len));
+    }
+    io_out_destroy(w->out);
+    return NULL;
+}
+
+MACRO_TEST(io_out_thread_local_writers_share_one_output) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "shared");
+    const size_t num_threads = 4, num_records = 100000;
+
+    /* sorted, hash partitioned, range partitioned and range partitioned
+       with a bucketed spill */
+    for (size_t t = 0; t < 4; t++) {
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_prefix());
+        io_out_options_buffer_size(&opt, 1024 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_bytes_records, NULL);
+        if (t > 0)
+            io_out_ext_options_num_partitions(&x, 8);
+        if (t == 1)
+            io_out_ext_options_partition(&x, io_hash_partition, NULL);
+        else if (t > 1)
+            io_out_ext_options_range_partition(&x, 0);
+        if (t == 3)
+            io_out_ext_options_bucketed_spill(&x);
+
+        io_out_t *out = io_out_ext_init(f, &opt, &x);
+        local_writer_t w[4];
+        pthread_t threads[4];
+        uint64_t sum = 0;
+        for (size_t i = 0; i < num_threads; i++) {
+            w[i].out = io_out_thread_local(out);
+            w[i].seed = i + 1;
+            w[i].num_records = num_records;
+            uint32_t v = w[i].seed;
+            for (size_t j = 0; j < num_records; j++) {
+                v = v * 1103515245 + 12345;
+                sum += v >> 4;
+            }
+        }
+        for (size_t i = 0; i < num_threads; i++)
+            pthread_create(threads + i, NULL, write_thread_local, w + i);
+        for (size_t i = 0; i < num_threads; i++)
+            pthread_join(threads[i], NULL);
+
+        io_in_t *in = io_out_in(out);
+        MACRO_ASSERT_TRUE(in != NULL);
+        size_t n = 0;
+        char last[48] = "";
+        io_record_t *r;
+        while ((r = io_in_advance(in)) != NULL) {
+            MACRO_ASSERT_TRUE(r->length == 10 && memcmp(last, r->record, 10) <= 0);
+            memcpy(last, r->record, 10);
+            last[10] = 0;
+            sum -= strtoul(last, NULL, 10);
+            n++;
+        }
+        io_in_destroy(in);
+        MACRO_ASSERT_EQ_SZ(n, num_threads * num_records);
+        MACRO_ASSERT_TRUE(sum == 0);
+        MACRO_ASSERT_TRUE(rmdir(td) == 0);
+        MACRO_ASSERT_TRUE(mkdir(td, 0700) == 0);
+    }
+    rmdir(td); aml_free(td);
+}
+
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+} fixed_kv_t;
+
+static int cmp_fixed_kv(const void *p1, const void *p2, void *arg) {
+    (void)arg;
+    const fixed_kv_t *a = (const fixed_kv_t *)p1;
+    const fixed_kv_t *b = (const fixed_kv_t *)p2;
+    return a->key < b->key ? -1 : (a->key > b->key ? 1 : 0);
+}
+
+static bool sum_fixed_kv(char *d, size_t num_r, void *arg) {
+    (void)arg;
+    fixed_kv_t *r = (fixed_kv_t *)d;
+    for (size_t i = 1; i < num_r; i++)
+        r->count += r[i].count;
+    return true;
+}
+
+MACRO_TEST(io_out_ext_fixed_sorted_and_reduced) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "fixed");
+
+    io_out_options_t opt;
+    io_out_options_init(&opt);
+    io_out_options_format(&opt, io_fixed(sizeof(fixed_kv_t)));
+    io_out_options_buffer_size(&opt, 64 * 1024); /* several tmp files */
+
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_fixed_compare(&x, cmp_fixed_kv, NULL);
+    io_out_ext_options_fixed_reducer(&x, sum_fixed_kv, NULL);
+
+    io_out_t *out = io_out_ext_init(f, &opt, &x);
+    MACRO_ASSERT_TRUE(out != NULL);
+    const size_t num_records = 50000, num_keys = 3000;
+    uint32_t v = 3;
+    for (size_t i = 0; i < num_records; i++) {
+        v = v * 1103515245 + 12345;
+        fixed_kv_t kv = { (v >> 8) % num_keys, 1 };
+        MACRO_ASSERT_TRUE(io_out_write_record(out, &kv, sizeof(kv)));
+    }
+    io_out_destroy(out);
+
+    io_in_options_t io;
+    io_in_options_init(&io);
+    io_in_options_format(&io, io_fixed(sizeof(fixed_kv_t)));
+    io_in_t *in = io_in_init(f, &io);
+    MACRO_ASSERT_TRUE(in != NULL);
+    size_t n = 0, total = 0;
+    uint64_t last = 0;
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        MACRO_ASSERT_EQ_SZ(r->length, sizeof(fixed_kv_t));
+        fixed_kv_t kv;
+        memcpy(&kv, r->record, sizeof(kv));
+        if (n)
+            MACRO_ASSERT_TRUE(kv.key > last);
+        last = kv.key;
+        total += kv.count;
+        n++;
+    }
+    MACRO_ASSERT_EQ_SZ(n, num_keys);
+    MACRO_ASSERT_EQ_SZ(total, num_records);
+    io_in_destroy(in);
+
+    remove(f);
+    rmdir(td); aml_free(td);
+}
+
+static int cmp_kv_records(const io_record_t *a, const io_record_t *b,
+                          void *arg) {
+    return cmp_fixed_kv(a->record, b->record, arg);
+}
+
+static bool sum_kv_records(io_record_t *res, const io_record_t *r,
+                           size_t num_r, aml_buffer_t *bh, void *arg) {
+    (void)arg;
+    fixed_kv_t kv;
+    memcpy(&kv, r[0].record, sizeof(kv));
+    for (size_t i = 1; i < num_r; i++) {
+        fixed_kv_t kv2;
+        memcpy(&kv2, r[i].record, sizeof(kv2));
+        kv.count += kv2.count;
+    }
+    aml_buffer_set(bh, &kv, sizeof(kv));
+    *res = r[0];
+    res->record = aml_buffer_data(bh);
+    return true;
+}
+
+static uint64_t hash_kv_record(const io_record_t *r, void *arg) {
+    (void)arg;
+    fixed_kv_t kv;
+    memcpy(&kv, r->record, sizeof(kv));
+    return kv.key * 0x9E3779B97F4A7C15ULL;
+}
+
+static size_t kv_partition(const io_record_t *r, size_t num_part,
+                           void *arg) {
+    return hash_kv_record(r, arg) % num_part;
+}
+
+MACRO_TEST(io_out_ext_fixed_compare_partitioned) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "fixed_parts");
+
+    /* a fixed compare in place of a compare with hash and range partitions,
+       read back through io_out_in */
+    for (int range = 0; range < 2; range++) {
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_fixed(sizeof(fixed_kv_t)));
+        io_out_options_buffer_size(&opt, 64 * 1024);
+
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_fixed_compare(&x, cmp_fixed_kv, NULL);
+        io_out_ext_options_fixed_reducer(&x, sum_fixed_kv, NULL);
+        io_out_ext_options_num_partitions(&x, 4);
+        if (range)
+            io_out_ext_options_range_partition(&x, 0);
+        else
+            io_out_ext_options_partition(&x, kv_partition, NULL);
+
+        io_out_t *out = io_out_ext_init(f, &opt, &x);
+        MACRO_ASSERT_TRUE(out != NULL);
+        const size_t num_records = 50000, num_keys = 3000;
+        uint32_t v = 5;
+        for (size_t i = 0; i < num_records; i++) {
+            v = v * 1103515245 + 12345;
+            fixed_kv_t kv = { (v >> 8) % num_keys, 1 };
+            MACRO_ASSERT_TRUE(io_out_write_record(out, &kv, sizeof(kv)));
+        }
+
+        io_in_t *in = io_out_in(out);
+        MACRO_ASSERT_TRUE(in != NULL);
+        size_t n = 0, total = 0;
+        uint64_t last = 0;
+        io_record_t *r;
+        while ((r = io_in_advance(in)) != NULL) {
+            MACRO_ASSERT_EQ_SZ(r->length, sizeof(fixed_kv_t));
+            fixed_kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if (n)
+                MACRO_ASSERT_TRUE(kv.key > last);
+            last = kv.key;
+            total += kv.count;
+            n++;
+        }
+        io_in_destroy(in);
+        MACRO_ASSERT_EQ_SZ(n, num_keys);
+        MACRO_ASSERT_EQ_SZ(total, num_records);
+
+        MACRO_ASSERT_TRUE(rmdir(td) == 0);
+        MACRO_ASSERT_TRUE(mkdir(td, 0700) == 0);
+    }
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_out_ext_combiner_reduces_before_spilling) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; path_join(f, td, "combined");
+
+    /* 1000 keys fit in the buffer once combined, 20000 do not */
+    const size_t num_keys[] = {1000, 20000};
+    for (size_t t = 0; t < 2; t++) {
+        io_out_options_t opt;
+        io_out_options_init(&opt);
+        io_out_options_format(&opt, io_prefix());
+        io_out_options_buffer_size(&opt, 64 * 1024);
+
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_kv_records, NULL);
+        io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+        io_out_ext_options_combiner(&x, hash_kv_record, NULL);
+
+        io_out_t *out = io_out_ext_init(f, &opt, &x);
+        const size_t num_records = 100000;
+        bool *seen = (bool *)aml_zalloc(num_keys[t] * sizeof(bool));
+        size_t num_unique = 0;
+        uint32_t v = 5;
+        for (size_t i = 0; i < num_records; i++) {
+            v = v * 1103515245 + 12345;
+            fixed_kv_t kv = { (v >> 8) % num_keys[t], 1 };
+            if (!seen[kv.key]) { seen[kv.key] = true; num_unique++; }
+            MACRO_ASSERT_TRUE(io_out_write_record(out, &kv, sizeof(kv)));
+        }
+        aml_free(seen);
+
+        size_t num_files = 0;
+        io_file_info_t *files = io_list(td, &num_files, NULL, NULL);
+        aml_free(files);
+        if (t == 0)
+            MACRO_ASSERT_EQ_SZ(num_files, 0);
+        else
+            MACRO_ASSERT_TRUE(num_files > 0);
+
+        io_in_t *in = io_out_in(out);
+        MACRO_ASSERT_TRUE(in != NULL);
+        size_t n = 0, total = 0;
+        uint64_t last = 0;
+        io_record_t *r;
+        while ((r = io_in_advance(in)) != NULL) {
+            MACRO_ASSERT_EQ_SZ(r->length, sizeof(fixed_kv_t));
+            fixed_kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if (n)
+                MACRO_ASSERT_TRUE(kv.key > last);
+            last = kv.key;
+            total += kv.count;
+            n++;
+        }
+        MACRO_ASSERT_EQ_SZ(n, num_unique);
+        MACRO_ASSERT_EQ_SZ(total, num_records);
+        io_in_destroy(in);
+    }
+    rmdir(td); aml_free(td);
+}
+
 MACRO_TEST(io_out_options_lz4_gz_and_ext_options_api_surface) {
     /* Exercise options API without actually writing compressed/partitioned output */
     io_out_options_t o;
@@ -128,6 +1284,24 @@ int main(void) {
 
     MACRO_ADD(tests, io_out_options_and_basic_write_record_delimited);
     MACRO_ADD(tests, io_out_write_and_write_delimiter_with_fd_owner);
+    MACRO_ADD(tests, io_out_lz4_threads_matches_single_thread);
+    MACRO_ADD(tests, io_out_gz_threads_and_bgzf_read_back);
+    MACRO_ADD(tests, io_out_ext_sorted_with_key_prefix);
+    MACRO_ADD(tests, io_out_ext_sorted_with_radix_sort);
+    MACRO_ADD(tests, io_out_ext_sorted_with_sort_threads);
+    MACRO_ADD(tests, io_out_ext_fixed_sorted_and_reduced);
+    MACRO_ADD(tests, io_out_ext_fixed_compare_partitioned);
+    MACRO_ADD(tests, io_out_ext_combiner_reduces_before_spilling);
+    MACRO_ADD(tests, io_out_ext_replacement_selection);
+    MACRO_ADD(tests, io_out_ext_sorted_presorted_input);
+    MACRO_ADD(tests, io_out_ext_sorted_cascade_merge);
+    MACRO_ADD(tests, io_out_ext_sorted_with_tmp_dirs);
+    MACRO_ADD(tests, io_out_ext_sorted_with_limit);
+    MACRO_ADD(tests, io_out_ext_range_partitioned_output_is_globally_sorted);
+    MACRO_ADD(tests, io_out_ext_partitioned_in_reads_partitions);
+    MACRO_ADD(tests, io_out_ext_bucketed_spill_partitions);
+    MACRO_ADD(tests, io_out_ext_skewed_partitions_are_sorted);
+    MACRO_ADD(tests, io_out_thread_local_writers_share_one_output);
     MACRO_ADD(tests, io_out_options_lz4_gz_and_ext_options_api_surface);
 
     macro_run_all("the-io-library/io_out.h", tests, test_count);